@@ -1,17 +1,45 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each bucket has its own lock, which protects the list of
+// buffers in it and their dev, blockno and refcnt fields,
+// so bread() on different harts rarely contends. A miss
+// recycles the least recently used unreferenced buffer,
+// moving it from its bucket to the new block's bucket while
+// holding only one bucket lock at a time.
+//
+// Unreferenced buffers are also on one LRU list, least
+// recently released first, so a miss finds its victim at
+// the head. A buffer joins or leaves the list when its
+// refcnt becomes or stops being 0, with its bucket's lock
+// held as well as bcache.lrulock.
+// Lock order: bcache.lock, a bucket lock, bcache.lrulock.
+//
+// The cache is sized at boot to BCACHEPCT percent of free
+// memory. The buf headers for that many buffers are allocated
+// then, but their data lives in pages from kalloc(), BPERPAGE
+// buffers to a page, which are added as misses fill the cache.
+// When kalloc() runs out of memory it calls bshrink(), which
+// gives back pages whose buffers are all unreferenced; the
+// cache never shrinks below NBUF buffers.
+//
+// A buffer that holds no block (it was just added, or bshrink()
+// failed to take its page) has dev 0 and blockno set to its
+// index, so that it hashes to some bucket and matches no lookup.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwrite_async and later bwait to write several at once.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To hint that a block will be read soon, call breadahead.
 
 
 #include "types.h"
@@ -23,69 +51,287 @@
 #include "fs.h"
 #include "buf.h"
 
+#define BPERPAGE (PGSIZE / BSIZE)  // buffers sharing one data page
+
+struct bucket {
+  struct spinlock lock;
+  struct buf head;  // circular list of buffers, through prev/next
+  uint64 hits;
+  uint64 misses;
+};
+
 struct {
+  // protects which buffers have data pages, and serializes
+  // growing and shrinking. Taken before any bucket lock.
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *buf;        // headers of all buffers the cache may hold
+  int nbuf;               // length of buf[], a multiple of BPERPAGE
+  int npage;              // data pages the cache holds now
+  struct bucket *bucket;
+  int nbucket;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct spinlock lrulock;
+  struct buf lru;         // circular list through lprev/lnext,
+                          // least recently used first
 } bcache;
 
+#define BHASH(dev, blockno) \
+  (&bcache.bucket[((dev) * 31 + (blockno)) % bcache.nbucket])
+
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+static void
+bucket_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Put b, which has just become unreferenced, on the LRU list:
+// at the tail, or at the head if it holds no block, so that it
+// is reused first. Caller must hold the lock of b's bucket.
+static void
+lru_insert(struct buf *b)
+{
+  struct buf *h = &bcache.lru;
+
+  acquire(&bcache.lrulock);
+  if(b->dev == 0){
+    b->lnext = h->lnext;
+    b->lprev = h;
+  } else {
+    b->lnext = h;
+    b->lprev = h->lprev;
+  }
+  b->lprev->lnext = b;
+  b->lnext->lprev = b;
+  release(&bcache.lrulock);
+}
+
+// Take b off the LRU list.
+// Caller must hold the lock of b's bucket.
+static void
+lru_remove(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  b->lprev->lnext = b->lnext;
+  b->lnext->lprev = b->lprev;
+  b->lprev = b->lnext = 0;
+  release(&bcache.lrulock);
+}
+
+// Put b, which holds no block and is on no list,
+// back into the cache as an empty buffer.
+static void
+bempty(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->dev = 0;
+  b->blockno = b - bcache.buf;
+  b->valid = 0;
+  b->refcnt = 0;
+  bk = BHASH(b->dev, b->blockno);
+  acquire(&bk->lock);
+  bucket_insert(bk, b);
+  lru_insert(b);
+  release(&bk->lock);
+}
+
+// Smallest kalloc_order() block that holds n bytes.
+// binit() keeps n within the largest.
+static int
+border(uint64 n)
+{
+  int k;
+
+  for(k = 0; k < MAXORDER; k++)
+    if(((uint64)PGSIZE << k) >= n)
+      return k;
+  return MAXORDER;
+}
+
+// Add a data page, and so BPERPAGE empty buffers, to the cache.
+// Returns 0, or -1 if the cache is full or out of memory.
+static int
+bgrow(void)
+{
+  char *pg;
+  struct buf *b;
+  int i;
+
+  if((pg = kalloc()) == 0)
+    return -1;
+
+  acquire(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf + bcache.nbuf; b += BPERPAGE)
+    if(b->data == 0)
+      break;
+  if(b == bcache.buf + bcache.nbuf){
+    release(&bcache.lock);
+    kfree(pg);
+    return -1;
+  }
+  for(i = 0; i < BPERPAGE; i++){
+    b[i].data = (uchar*)pg + i*BSIZE;
+    bempty(&b[i]);
+  }
+  bcache.npage++;
+  release(&bcache.lock);
+  return 0;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  uint64 n, max;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache.lru");
+  bcache.lru.lprev = &bcache.lru;
+  bcache.lru.lnext = &bcache.lru;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  n = kfreepages() * BCACHEPCT / 100 * BPERPAGE;
+  if(n < NBUF)
+    n = NBUF;
+  n = (n + BPERPAGE - 1) / BPERPAGE * BPERPAGE;
+  // the headers must fit in one kalloc_order() block.
+  max = ((uint64)PGSIZE << MAXORDER) / sizeof(struct buf) / BPERPAGE * BPERPAGE;
+  if(n > max){
+    printf("binit: BCACHEPCT %d is too big; using %ld buffers\n", BCACHEPCT, max);
+    n = max;
   }
+  bcache.nbuf = n;
+  bcache.nbucket = (n / 4) | 1;
+
+  bcache.buf = kalloc_order(border(n * sizeof(struct buf)));
+  bcache.bucket = kalloc_order(border(bcache.nbucket * sizeof(struct bucket)));
+  if(bcache.buf == 0 || bcache.bucket == 0)
+    panic("binit");
+  memset(bcache.buf, 0, n * sizeof(struct buf));
+  memset(bcache.bucket, 0, bcache.nbucket * sizeof(struct bucket));
+
+  for(bk = bcache.bucket; bk < bcache.bucket + bcache.nbucket; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  for(n = 0; n < bcache.nbuf; n++)
+    initsleeplock(&bcache.buf[n].lock, "buffer");
+
+  // the log needs NBUF buffers no matter what.
+  while(bcache.npage * BPERPAGE < NBUF)
+    if(bgrow() < 0)
+      panic("binit: bgrow");
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block blockno on device dev in bucket bk.
+// If found, take a reference. Caller must hold bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bucket_lookup(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      if(b->refcnt++ == 0)
+        lru_remove(b);
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
+// Remove the least recently used unreferenced buffer
+// from its bucket and return it with refcnt 1, or 0 if
+// every buffer is in use.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  uint dev, blockno;
+
+  for(;;){
+    // the buffers on the LRU list keep their dev and blockno,
+    // and so their bucket, until they are taken off it.
+    acquire(&bcache.lrulock);
+    b = bcache.lru.lnext;
+    if(b == &bcache.lru){
+      release(&bcache.lrulock);
+      return 0;
+    }
+    dev = b->dev;
+    blockno = b->blockno;
+    release(&bcache.lrulock);
+
+    // it may have been used or taken since we looked.
+    bk = BHASH(dev, blockno);
+    acquire(&bk->lock);
+    if(b->lnext && b->dev == dev && b->blockno == blockno){
+      lru_remove(b);
+      bucket_remove(b);
       b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      release(&bk->lock);
       return b;
     }
+    release(&bk->lock);
+  }
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct bucket *bk = BHASH(dev, blockno);
+  struct buf *b, *nb;
+
+  acquire(&bk->lock);
+
+  // Is the block already cached?
+  if((b = bucket_lookup(bk, dev, blockno)) != 0){
+    bk->hits++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  bk->misses++;
+  release(&bk->lock);
+
+  // Not cached. Grow the cache if it is below its
+  // target size, then recycle the least recently
+  // used (LRU) unused buffer.
+  if(bcache.npage * BPERPAGE < bcache.nbuf)
+    bgrow();
+  if((nb = bevict()) == 0)
+    panic("bget: no buffers");
+
+  acquire(&bk->lock);
+  // another process may have cached the block meanwhile;
+  // if so, leave the recycled buffer empty.
+  if((b = bucket_lookup(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    bempty(nb);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  nb->dev = dev;
+  nb->blockno = blockno;
+  nb->valid = 0;
+  bucket_insert(bk, nb);
+  release(&bk->lock);
+  acquiresleep(&nb->lock);
+  return nb;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +348,57 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading the indicated block into the cache, if it is
+// not there already, without waiting for the disk.
+// Returns 0, or -1 if the disk queue is too busy to take
+// the read.
+int
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk = BHASH(dev, blockno);
+  struct buf *b;
+
+  // don't count a hit, or wait for a buffer someone is using.
+  acquire(&bk->lock);
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bk->lock);
+      return 0;
+    }
+  }
+  release(&bk->lock);
+
+  b = bget(dev, blockno);
+  if(b->valid)
+    brelse(b);
+  else if(virtio_disk_trystart(b, 0, bdone) < 0){
+    brelse(b);
+    return -1;
+  }
+  // otherwise bdone() releases b when the read finishes.
+  return 0;
+}
+
+// Called by the disk interrupt when a read started by
+// breadahead() finishes. Like brelse(), but b's sleep-lock
+// belongs to the process that started the read.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  bk = BHASH(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    lru_insert(b);
+  }
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +408,157 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, without waiting.
+// The caller must keep b locked, and not change it,
+// until bwait(b) returns.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  virtio_disk_start(b, 1, 0);
+}
+
+// Wait for a write started by bwrite_async() to finish.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Send reads and writes started by breadahead() and
+// bwrite_async() to the disk; until then, the disk
+// driver holds them back to merge adjacent blocks.
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else holds it, it becomes the most recently
+// used, and the last that bevict() will take.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = BHASH(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    lru_insert(b);
+  }
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);
+  struct bucket *bk = BHASH(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  if(b->refcnt++ == 0)
+    lru_remove(b);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
+  struct bucket *bk = BHASH(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  if(--b->refcnt == 0)
+    lru_insert(b);
+  release(&bk->lock);
+}
+
+// Take the BPERPAGE buffers starting at b off their lists,
+// if none of them is in use. Returns 0 on success; otherwise
+// leaves any it took off as empty buffers and returns -1.
+// Caller must hold bcache.lock.
+static int
+bdetach(struct buf *b)
+{
+  struct bucket *bk;
+  int i, ok;
+
+  for(i = 0; i < BPERPAGE; i++){
+    bk = BHASH(b[i].dev, b[i].blockno);
+    acquire(&bk->lock);
+    // an unreferenced buffer is on its bucket's list and the
+    // LRU list; one on its way between buckets is on neither.
+    ok = b[i].lnext != 0;
+    if(ok){
+      lru_remove(&b[i]);
+      bucket_remove(&b[i]);
+    }
+    release(&bk->lock);
+    if(!ok){
+      while(--i >= 0)
+        bempty(&b[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Give up to n data pages back to the page allocator, taking
+// them from buffers that are not in use (unreferenced buffers
+// are never dirty: the log pins the ones it has yet to write).
+// Called by kalloc() when it runs out of memory, so it must not
+// sleep or allocate. Returns the number of pages freed.
+//
+// Since any kalloc() may get here, every spinlock that is held
+// around a kalloc() comes before bcache.lock, the bucket locks
+// and bcache.lrulock in the lock order; so no code may call
+// kalloc() while holding a buffer cache lock (bgrow() calls it
+// first), and the buffer cache takes no other locks while
+// holding its own, except the page allocator's in kfree().
+int
+bshrink(int n)
+{
+  struct buf *b;
+  void *pg;
+  int i, g, freed = 0;
+
+  if(bcache.nbuf == 0)
+    return 0;  // called during boot.
+
   acquire(&bcache.lock);
-  b->refcnt--;
+  for(g = bcache.nbuf / BPERPAGE - 1; g >= 0; g--){
+    if(freed >= n || (bcache.npage - 1) * BPERPAGE < NBUF)
+      break;
+    b = &bcache.buf[g * BPERPAGE];
+    if(b->data == 0 || bdetach(b) < 0)
+      continue;
+    pg = b->data;
+    for(i = 0; i < BPERPAGE; i++)
+      b[i].data = 0;
+    bcache.npage--;
+    kfree(pg);
+    freed++;
+  }
   release(&bcache.lock);
+  return freed;
 }
 
+// Print buffer cache statistics, for debugging.
+// Runs when user types ^P on console.
+void
+bcachedump(void)
+{
+  uint64 hits = 0, misses = 0;
 
+  for(int i = 0; i < bcache.nbucket; i++){
+    hits += bcache.bucket[i].hits;
+    misses += bcache.bucket[i].misses;
+  }
+  printf("bcache: %d of %d buffers, %ld hits, %ld misses\n",
+         bcache.npage * BPERPAGE, bcache.nbuf, hits, misses);
+}
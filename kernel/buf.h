@@ -5,8 +5,13 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *lprev; // LRU list, while refcnt is 0; else 0
+  struct buf *lnext;
+  uchar *data;      // BSIZE bytes in a page shared with other bufs
+  struct buf *qnext; // disk queue
+  char qwrite;      // queued to be written, not read
+  void (*done)(struct buf *); // for the disk interrupt to call, or 0
 };
 
@@ -82,10 +82,20 @@ consoleread(int user_dst, uint64 dst, int n)
   uint target;
   int c;
   char cbuf;
+  uint64 pg = -1;
 
   target = n;
   acquire(&cons.lock);
   while(n > 0){
+    if(user_dst && PGROUNDDOWN(dst) != pg){
+      // fault in the next page of the destination without
+      // the lock; see uvmprefault().
+      pg = PGROUNDDOWN(dst);
+      release(&cons.lock);
+      uvmprefault(myproc()->pagetable, dst, 1, 1);
+      acquire(&cons.lock);
+    }
+
     // wait until interrupt handler has put some
     // input into cons.buffer.
     while(cons.r == cons.w){
@@ -138,8 +148,12 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and memory statistics.
     procdump();
+    kmemdump();
+    bcachedump();
+    dcachedump();
+    virtio_disk_dump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
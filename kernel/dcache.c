@@ -0,0 +1,156 @@
+// Cache of directory entries, for path name lookup.
+//
+// Each entry records that directory dir on device dev maps
+// name to inode inum, or, if inum is 0, that it has no entry
+// called name. dirlookup() fills the cache and consults it,
+// and namex() consults it before locking a directory: an
+// entry exists only for a directory, so a hit needs neither
+// the directory's lock nor a read of its blocks.
+//
+// Entries are added and changed with the directory locked:
+// dirlookup() adds what it finds, dirlink() and unlink()
+// record the entries they write, and iput() drops a
+// directory's entries when it frees the directory. dcget()
+// takes its reference to the inode under dcache.lock, so an
+// inode found in the cache cannot be freed before the caller
+// holds it. A full cache replaces entries round-robin.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NDCACHE   256  // cached entries
+#define NDHASH    61   // hash buckets, keyed by directory and name
+
+struct dentry {
+  uint dev;
+  uint dir;             // inum of the directory; 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if dir has no entry called name
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *bucket[NDHASH];
+  int hand;             // next entry to replace
+  uint64 hits;
+  uint64 misses;
+} dcache;
+
+void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dchash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.bucket[h % NDHASH];
+}
+
+// Return the entry for name in dp, or 0.
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dchash(dp->dev, dp->inum, name); d; d = d->next)
+    if(d->dev == dp->dev && d->dir == dp->inum && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Remove entry d from its bucket.
+// Caller must hold dcache.lock.
+static void
+dcdrop(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dchash(d->dev, d->dir, d->name); *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+  d->dir = 0;
+}
+
+// Look up name in directory dp. On a hit, returns 1 and sets
+// *ipp to the inode, with a reference for the caller, or to 0
+// if dp has no such entry. Returns 0 on a miss.
+// dp need not be locked.
+int
+dcget(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    dcache.misses++;
+    release(&dcache.lock);
+    return 0;
+  }
+  dcache.hits++;
+  *ipp = d->inum ? iget(dp->dev, d->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that directory dp maps name to inum (0 for no entry).
+// Caller must hold dp->lock.
+void
+dcput(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d, **bp;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    d = &dcache.ent[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(d->dir)
+      dcdrop(d);
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    bp = dchash(d->dev, d->dir, d->name);
+    d->next = *bp;
+    *bp = d;
+  }
+  d->inum = inum;
+  release(&dcache.lock);
+}
+
+// Directory dp is being freed: forget its entries.
+void
+dcpurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      dcdrop(d);
+  release(&dcache.lock);
+}
+
+// Print name cache statistics, for debugging.
+// Runs when user types ^P on console.
+void
+dcachedump(void)
+{
+  printf("dcache: %ld hits, %ld misses\n", dcache.hits, dcache.misses);
+}
@@ -2,26 +2,42 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+int             breadahead(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            bkick(void);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+void            bcachedump(void);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcinit(void);
+int             dcget(struct inode*, char*, struct inode**);
+void            dcput(struct inode*, char*, uint);
+void            dcpurge(struct inode*);
+void            dcachedump(void);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -33,6 +49,8 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+void            fileahead(struct file*, uint, uint);
+int             filewritemax(void);
 
 // fs.c
 void            fsinit(int);
@@ -40,6 +58,7 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -52,7 +71,9 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             ireadahead(struct inode*, uint, int);
 void            itrunc(struct inode*);
+void            iextent(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -63,14 +84,23 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            kmemdump(void);
+uint64          kfreepages(void);
+void            kcheck(void);
+void            kref(void *);
+int             krefcnt(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
-void            begin_op(void);
+void            begin_op(int);
+int             logopmax(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -100,9 +130,13 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+int             schedtick(void);
+void            schedboost(void);
+int             setnice(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -118,6 +152,12 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -141,12 +181,22 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// text.c
+void            textinit(void);
+uint64          textget(struct inode*, uint, uint);
+void            textput(struct inode*, uint, uint, uint64);
+void            textinval(struct inode*);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            clockupdate(void);
+void            tickwait(uint);
+void            timerset(int);
+void            ipi(int);
 
 // uart.c
 void            uartinit(void);
@@ -165,8 +215,13 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+uint64          vmfault(pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmapsparse(pagetable_t, uint64, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
@@ -174,6 +229,15 @@ int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// vma.c
+uint64          mmap(uint64, uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+struct vma*     vmamapped(struct proc*, uint64);
+uint64          vmabase(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+void            vmafree(struct proc*);
+uint64          vmafault(struct proc*, uint64, int);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -183,6 +247,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int, void (*)(struct buf *));
+int             virtio_disk_trystart(struct buf *, int, void (*)(struct buf *));
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_kick(void);
+void            virtio_disk_dump(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -4,34 +4,42 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
-int flags2perm(int flags)
+int flags2prot(int flags)
 {
-    int perm = 0;
+    int prot = PROT_READ;
     if(flags & 0x1)
-      perm = PTE_X;
+      prot |= PROT_EXEC;
     if(flags & 0x2)
-      perm |= PTE_W;
-    return perm;
+      prot |= PROT_WRITE;
+    return prot;
 }
 
+// The program's segments are not read in here. Each becomes a
+// private file mapping (see vma.c) whose pages are read from
+// the file when first touched; the part of a segment beyond
+// its file contents, such as the bss, is zero-filled on demand.
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma seg[NVMA];
+  struct file *f = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
-  begin_op();
+  begin_op(OPBLOCKS_IPUT);
 
   if((ip = namei(path)) == 0){
     end_op();
@@ -49,7 +57,20 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // The segments' pages will be read through this file.
+  if((f = filealloc()) == 0)
+    goto bad;
+  f->type = FD_INODE;
+  f->ip = idup(ip);
+  f->off = 0;
+  f->readable = 1;
+  f->writable = 0;
+  // the file may not be written while the program runs, since
+  // its pages are read from it on demand. fileclose() undoes this.
+  f->exec = 1;
+  __sync_fetch_and_add(&ip->nexec, 1);
+
+  // Record the program's segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,12 +82,23 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < PGROUNDUP(sz) || ph.vaddr + ph.memsz > TRAPFRAME)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
+    if(ph.memsz == 0)
+      continue;
+    if(nseg >= NVMA)
+      goto bad;
+    seg[nseg].addr = ph.vaddr;
+    seg[nseg].len = PGROUNDUP(ph.memsz);
+    seg[nseg].prot = flags2prot(ph.flags);
+    seg[nseg].flags = MAP_PRIVATE;
+    seg[nseg].f = f;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -79,6 +111,8 @@ exec(char *path, char **argv)
   // Make the first inaccessible as a stack guard.
   // Use the rest as the user stack.
   sz = PGROUNDUP(sz);
+  if(sz + (USERSTACK+1)*PGSIZE > TRAPFRAME)
+    goto bad;
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_W)) == 0)
     goto bad;
@@ -121,12 +155,18 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmafree(p);
+  for(i = 0; i < nseg; i++){
+    p->vma[i] = seg[i];
+    filedup(f);
+  }
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  fileclose(f);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,30 +177,7 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(f)
+    fileclose(f);
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -14,15 +14,20 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from a slab cache, so the number
+// of open files is limited only by memory.
+// ftable.lock protects the reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,11 +72,14 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    if(ff.exec)
+      __sync_fetch_and_sub(&ff.ip->nexec, 1);
+    begin_op(OPBLOCKS_IPUT);
     iput(ff.ip);
     end_op();
   }
@@ -101,12 +104,50 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Readahead window limits, in blocks.
+#define RAMIN 4
+#define RAMAX 32
+
+// f has just been read, or faulted in, from off to off+n.
+// If that continues the previous access, read the next
+// blocks ahead into the buffer cache, twice as many each
+// time the file keeps being read sequentially.
+// Caller must hold f->ip->lock.
+void
+fileahead(struct file *f, uint off, uint n)
+{
+  uint bn;
+
+  if(f->nora || n == 0)
+    return;
+  if(off != f->ranext){
+    // random access: start over.
+    f->ranext = off + n;
+    f->rawin = 0;
+    return;
+  }
+  f->ranext = off + n;
+  f->rawin = f->rawin == 0 ? RAMIN : f->rawin * 2;
+  if(f->rawin > RAMAX)
+    f->rawin = RAMAX;
+
+  // read ahead from the first block not yet read,
+  // or already asked for.
+  bn = (off + n) / BSIZE;
+  if(f->raend > bn && f->raend < bn + f->rawin)
+    bn = f->raend;
+  else if(f->raend >= bn + f->rawin)
+    return;
+  f->raend = bn + ireadahead(f->ip, bn, (off + n) / BSIZE + f->rawin - bn);
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
 fileread(struct file *f, uint64 addr, int n)
 {
   int r = 0;
+  uint m, done;
 
   if(f->readable == 0)
     return -1;
@@ -118,9 +159,24 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // fault in as much of the destination as readi() will
+    // fill, with the inode unlocked (see uvmprefault());
+    // check again after relocking, in case the file grew.
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    for(done = 0; n > 0; done = m){
+      m = f->off < f->ip->size ? f->ip->size - f->off : 0;
+      if(m > n)
+        m = n;
+      if(m <= done)
+        break;
+      iunlock(f->ip);
+      uvmprefault(myproc()->pagetable, addr, m, 1);
+      ilock(f->ip);
+    }
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
+      fileahead(f, f->off, r);
       f->off += r;
+    }
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -129,6 +185,15 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Most bytes that one log operation can write to a file.
+int
+filewritemax(void)
+{
+  int max = (logopmax() - OPBLOCKS_WRITE(0)) / 2 * BSIZE;
+
+  return max < NINDIRECT * BSIZE ? max : NINDIRECT * BSIZE;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
@@ -146,20 +211,20 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as one log
+    // operation can hold (see OPBLOCKS_WRITE).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = filewritemax();
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      // fault in the source while no locks are held.
+      uvmprefault(myproc()->pagetable, addr + i, n1, 0);
+      begin_op(OPBLOCKS_WRITE(n1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
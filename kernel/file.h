@@ -7,6 +7,11 @@ struct file {
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
+  char nora;         // FD_INODE: opened O_NOREADAHEAD
+  uint ranext;       // FD_INODE: offset where a sequential read would start
+  uint rawin;        // FD_INODE: readahead window, in blocks; 0 if not sequential
+  uint raend;        // FD_INODE: blocks before this one have been read ahead
+  char exec;         // FD_INODE: maps a running program; see exec()
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -18,6 +23,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash chain
+  struct inode *lprev; // LRU list, while ref is 0
+  struct inode *lnext;
+  int nexec;          // files mapping it as a running program; atomic
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +35,8 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  ushort flags;
+  uint addrs[NDIRECT+NLEVEL];
 };
 
 // map major device number to device functions.
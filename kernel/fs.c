@@ -26,6 +26,16 @@
 // only one device
 struct superblock sb; 
 
+// Where balloc() and ialloc() start looking. Like sb, there
+// should be one per device.
+struct {
+  struct spinlock lock;
+  uint bnext;   // no data block below this one is free
+  uint inext;   // no inode below this one is free
+} alloc;
+
+#define DATASTART (sb.size - sb.nblocks)  // first data block
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +54,28 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  readsb(dev, &sb);  // recovery may have changed the free counts
+  initlock(&alloc.lock, "alloc");
+  alloc.bnext = DATASTART;
+  alloc.inext = 1;
+}
+
+// Add dblocks and dinodes to the superblock's free counts,
+// on the disk and in sb.
+static void
+sbcount(int dev, int dblocks, int dinodes)
+{
+  struct buf *bp;
+  struct superblock *s;
+
+  bp = bread(dev, 1);
+  s = (struct superblock*)bp->data;
+  s->nfree += dblocks;
+  s->nifree += dinodes;
+  sb.nfree = s->nfree;
+  sb.nifree = s->nifree;
+  log_write(bp);
+  brelse(bp);
 }
 
 // Zero a block.
@@ -60,33 +92,98 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+// Mark the first free block in [from, to) in use in the
+// bitmap, and return it, or 0 if there is none.
+// Skips whole bytes of used blocks at a time.
 static uint
-balloc(uint dev)
+bscan(uint dev, uint from, uint to)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi, end;
+  int m;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = from; b < to; b = end){
+    end = min((b / BPB + 1) * BPB, to);
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    for(bi = b % BPB; b < end; b++, bi++){
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff && b + 8 <= end){
+        b += 7;
+        bi += 7;
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        return b;
       }
     }
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Count newly allocated block b, and zero it.
+static uint
+btake(uint dev, uint b)
+{
+  acquire(&alloc.lock);
+  if(b == alloc.bnext)
+    alloc.bnext = b + 1;
+  release(&alloc.lock);
+  sbcount(dev, -1, 0);
+  bzero(dev, b);
+  return b;
+}
+
+// Allocate a zeroed disk block, preferably the first free one
+// at or after goal in the same bitmap block, so that a file's
+// blocks end up near each other; otherwise the first free one
+// after alloc.bnext. goal 0 means no preference.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b = 0, next;
+
+  if(sb.nfree == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  acquire(&alloc.lock);
+  next = alloc.bnext;
+  release(&alloc.lock);
+
+  if(goal > next && goal < sb.size)
+    b = bscan(dev, goal, min((goal / BPB + 1) * BPB, sb.size));
+  if(b == 0){
+    // a concurrent bfree() may have put a free block below
+    // next without lowering it, so wrap around if need be.
+    if((b = bscan(dev, next, sb.size)) == 0)
+      b = bscan(dev, DATASTART, next);
+    if(b == 0){
+      printf("balloc: out of blocks\n");
+      return 0;
+    }
+    acquire(&alloc.lock);
+    if(alloc.bnext == next)
+      alloc.bnext = b;  // btake() moves it past b
+    release(&alloc.lock);
+  }
+  return btake(dev, b);
+}
+
+// Allocate disk block b, zeroed, if it is free.
+// returns b, or 0 if it is in use or not a data block.
+static uint
+balloc_at(uint dev, uint b)
+{
+  if(b < DATASTART || b >= sb.size || bscan(dev, b, b + 1) == 0)
+    return 0;
+  return btake(dev, b);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -102,6 +199,11 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  sbcount(dev, 1, 0);
+  acquire(&alloc.lock);
+  if(b < alloc.bnext)
+    alloc.bnext = b;
+  release(&alloc.lock);
 }
 
 // Inodes.
@@ -164,32 +266,163 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table keyed by (dev, inum), whose
+// entries come from a slab cache, so the number of inodes in
+// use is limited only by memory. Each bucket's spin-lock
+// protects its chain and the ref, dev, and inum fields of the
+// inodes on it; one must hold it while using any of those.
+//
+// An entry whose ref falls to zero stays in the table, still
+// valid, on a least-recently-used list, so that using the
+// inode again needs no disk read. The list holds at most
+// itable.max entries, sized at boot to ICACHEPCT percent of
+// free memory; past that, or when memory runs out, iget()
+// and iput() recycle or free its oldest entries.
+// itable.lock protects the list; take it after a bucket lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 127  // hash buckets
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;   // chain through ip->next
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode lru;     // unreferenced entries, most recent first
+  int nlru;
+  int max;              // most entries to keep on lru
+  struct kmem_cache *cache;
+  struct ibucket bucket[NIHASH];
 } itable;
 
+#define IHASH(dev, inum) (&itable.bucket[((dev) * 31 + (inum)) % NIHASH])
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.lru.lnext = &itable.lru;
+  itable.lru.lprev = &itable.lru;
+  itable.max = kfreepages() * ICACHEPCT / 100 * (PGSIZE / sizeof(struct inode));
+  if(itable.max < NINODE)
+    itable.max = NINODE;
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+  for(i = 0; i < NIHASH; i++) {
+    initlock(&itable.bucket[i].lock, "itable.bucket");
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
+// Put ip on the LRU list: at the front, or at the back if it
+// is not worth keeping. Caller must hold itable.lock.
+static void
+lru_insert(struct inode *ip)
+{
+  struct inode *at = ip->valid ? &itable.lru : itable.lru.lprev;
+
+  ip->lnext = at->lnext;
+  ip->lprev = at;
+  at->lnext->lprev = ip;
+  at->lnext = ip;
+  itable.nlru++;
+}
+
+// Caller must hold itable.lock.
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  itable.nlru--;
+}
+
+// Look for the inode in bucket bk. If found, take a
+// reference. Caller must hold bk->lock.
+static struct inode*
+ibucket_lookup(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        acquire(&itable.lock);
+        lru_remove(ip);
+        release(&itable.lock);
+      }
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Remove the least recently used unreferenced entry from the
+// table and return it, or 0 if there is none.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip, **pp;
+  struct ibucket *bk;
+
+  for(;;){
+    acquire(&itable.lock);
+    if((ip = itable.lru.lprev) == &itable.lru){
+      release(&itable.lock);
+      return 0;
+    }
+    // dev and inum do not change while ip is on the list.
+    bk = IHASH(ip->dev, ip->inum);
+    release(&itable.lock);
+
+    // it may have been taken since we looked.
+    acquire(&bk->lock);
+    for(pp = &bk->head; *pp && *pp != ip; pp = &(*pp)->next)
+      ;
+    if(*pp && ip->ref == 0){
+      *pp = ip->next;
+      acquire(&itable.lock);
+      lru_remove(ip);
+      release(&itable.lock);
+      release(&bk->lock);
+      return ip;
+    }
+    release(&bk->lock);
+  }
+}
+
+
+// Give the first free inode in [from, to) type type on the
+// disk, and return its number, or 0 if there is none.
+static uint
+iscan(uint dev, short type, uint from, uint to)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum = from;
+
+  while(inum < to){
+    bp = bread(dev, IBLOCK(inum, sb));
+    do {
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        brelse(bp);
+        return inum;
+      }
+      inum++;
+    } while(inum < to && inum % IPB != 0);
+    brelse(bp);
+  }
+  return 0;
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -198,21 +431,23 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
-  struct buf *bp;
-  struct dinode *dip;
-
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
+  uint inum, next;
+
+  if(sb.nifree > 0){
+    acquire(&alloc.lock);
+    next = alloc.inext;
+    release(&alloc.lock);
+    // wrap around as balloc() does.
+    if((inum = iscan(dev, type, next, sb.ninodes)) == 0)
+      inum = iscan(dev, type, 1, next);
+    if(inum){
+      acquire(&alloc.lock);
+      if(alloc.inext == next)
+        alloc.inext = inum + 1;
+      release(&alloc.lock);
+      sbcount(dev, 0, -1);
       return iget(dev, inum);
     }
-    brelse(bp);
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -233,6 +468,7 @@ iupdate(struct inode *ip)
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
+  dip->flags = ip->flags;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
@@ -243,37 +479,42 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct ibucket *bk = IHASH(dev, inum);
+  struct inode *ip, *nip;
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
-
-  // Recycle an inode entry.
-  if(empty == 0)
+  acquire(&bk->lock);
+  ip = ibucket_lookup(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Take a new entry, or recycle the least recently used.
+  if((nip = kmem_cache_alloc(itable.cache)) != 0)
+    initsleeplock(&nip->lock, "inode");
+  else if((nip = ievict()) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
-  release(&itable.lock);
-
-  return ip;
+  acquire(&bk->lock);
+  // another process may have added the inode meanwhile.
+  if((ip = ibucket_lookup(bk, dev, inum)) != 0){
+    release(&bk->lock);
+    kmem_cache_free(itable.cache, nip);
+    return ip;
+  }
+  nip->dev = dev;
+  nip->inum = inum;
+  nip->ref = 1;
+  nip->nexec = 0;
+  nip->valid = 0;
+  nip->next = bk->head;
+  bk->head = nip;
+  release(&bk->lock);
+
+  return nip;
 }
 
 // Increment reference count for ip.
@@ -281,9 +522,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = IHASH(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -306,6 +549,7 @@ ilock(struct inode *ip)
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
+    ip->flags = dip->flags;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
@@ -328,7 +572,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, once it is the least recently used.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,7 +580,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = IHASH(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +591,35 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    sbcount(ip->dev, 0, 1);
+    acquire(&alloc.lock);
+    if(ip->inum < alloc.inext)
+      alloc.inext = ip->inum;
+    release(&alloc.lock);
 
     releasesleep(&ip->lock);
 
+    acquire(&bk->lock);
+  }
+
+  if(--ip->ref == 0){
     acquire(&itable.lock);
+    lru_insert(ip);
+    release(&itable.lock);
   }
+  release(&bk->lock);
 
-  ip->ref--;
-  release(&itable.lock);
+  // keep the list to its size.
+  while(itable.nlru > itable.max && (ip = ievict()) != 0)
+    kmem_cache_free(itable.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -374,7 +635,18 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NINDIRECT^2
+// are listed in the blocks listed in block ip->addrs[NDIRECT+1]
+// (doubly indirect), and the next NINDIRECT^3 in a tree of
+// three levels under block ip->addrs[NDIRECT+2].
+//
+// An I_EXTENT inode instead lists its blocks as extents, runs
+// of contiguous blocks; see struct extent in fs.h. Finding a
+// block takes at most one metadata read, and a file that grows
+// one block at a time stays in one extent as long as the disk
+// block after its end is free.
+
+static uint emap(struct inode*, uint);
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -382,12 +654,19 @@ iunlockput(struct inode *ip)
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, *a, n, i;
   struct buf *bp;
+  int level;
+
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn);
 
+  // a new block goes after the one listed before it, if any,
+  // or else after the block listing it; the root of an
+  // indirect tree goes after the last direct block.
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -396,28 +675,134 @@ bmap(struct inode *ip, uint bn)
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  // find the tree of indirect blocks that holds bn,
+  // and the number of blocks it maps.
+  for(level = 1, n = NINDIRECT; bn >= n; level++, n *= NINDIRECT){
+    if(level == NLEVEL)
+      panic("bmap: out of range");
+    bn -= n;
+  }
+
+  // Load indirect blocks, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    addr = balloc(ip->dev, ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : 0);
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+  for(; level > 0; level--){
+    n /= NINDIRECT;  // blocks mapped by each entry of this block
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
+    i = bn / n;
+    if(a[i] == 0){
+      if((a[i] = balloc(ip->dev, i > 0 && a[i-1] ? a[i-1] + 1 : addr + 1)) != 0)
         log_write(bp);
-      }
     }
+    addr = a[i];
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    bn %= n;
+  }
+  return addr;
+}
+
+// bmap() for an I_EXTENT inode. If bn is just past the last
+// mapped block, adds it, extending the last extent if it can.
+// returns 0 if out of disk space or extents.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent *e = 0, *last = 0;
+  struct buf *bp = 0;
+  uint fbn = 0, addr = 0, goal;
+  int i;
+
+  // find the extent holding bn, or the first unused one.
+  for(i = 0; i < NIEXTENT + NXEXTENT; i++){
+    if(i == NIEXTENT){
+      if(ip->addrs[EXTBLOCK] == 0)
+        break;
+      bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+    }
+    if(i < NIEXTENT)
+      e = (struct extent*)ip->addrs + i;
+    else
+      e = (struct extent*)bp->data + (i - NIEXTENT);
+    if(e->len == 0)
+      break;
+    if(bn < fbn + e->len){
+      addr = e->start + (bn - fbn);
+      goto out;
+    }
+    fbn += e->len;
+    last = e;
+    e = 0;
+  }
+
+  // writei() only adds the block after the end.
+  if(bn != fbn)
+    goto out;
+
+  // a new extent starts as near the last one as it can.
+  goal = last ? last->start + last->len : 0;
+  if(last && (addr = balloc_at(ip->dev, goal)) != 0){
+    last->len++;
+  } else {
+    if(e == 0 && i == NIEXTENT){
+      // first extent that does not fit in the inode.
+      if((addr = balloc(ip->dev, goal)) == 0)
+        goto out;
+      ip->addrs[EXTBLOCK] = addr;
+      bp = bread(ip->dev, addr);
+      e = (struct extent*)bp->data;
+    }
+    if(e == 0 || (addr = balloc(ip->dev, goal)) == 0)
+      goto out;
+    e->start = addr;
+    e->len = 1;
   }
+  if(bp)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
-  panic("bmap: out of range");
+// Free the blocks of extent e.
+static void
+efree(uint dev, struct extent *e)
+{
+  for(uint i = 0; i < e->len; i++)
+    bfree(dev, e->start + i);
+  e->start = 0;
+  e->len = 0;
+}
+
+// Free indirect block addr and the blocks it lists,
+// which are themselves indirect blocks if level > 1.
+static void
+ifree(uint dev, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      ifree(dev, a[j], level - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -425,9 +810,28 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
   struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->nexec > 0)
+    panic("itrunc: running program");
+  textinval(ip);
+
+  if(ip->flags & I_EXTENT){
+    for(i = 0; i < NIEXTENT; i++)
+      efree(ip->dev, (struct extent*)ip->addrs + i);
+    if(ip->addrs[EXTBLOCK]){
+      bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+      for(i = 0; i < NXEXTENT; i++)
+        efree(ip->dev, (struct extent*)bp->data + i);
+      brelse(bp);
+      bfree(ip->dev, ip->addrs[EXTBLOCK]);
+      ip->addrs[EXTBLOCK] = 0;
+    }
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,22 +840,31 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->addrs[NDIRECT+i]){
+      ifree(ip->dev, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
   iupdate(ip);
 }
 
+// Map ip's data by extents from now on, if it has none.
+// Caller must hold ip->lock.
+void
+iextent(struct inode *ip)
+{
+  if(ip->size > 0 || (ip->flags & I_EXTENT))
+    return;
+  for(int i = 0; i < NDIRECT+NLEVEL; i++)
+    if(ip->addrs[i])
+      return;  // blocks left by a failed write
+  ip->flags |= I_EXTENT;
+  iupdate(ip);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -495,6 +908,29 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading blocks of ip from block bn on into the
+// buffer cache, up to n of them, without waiting for the
+// disk. Stops at the end of the file or when the disk is
+// busy. Returns the number of blocks started, or already
+// cached.
+// Caller must hold ip->lock.
+int
+ireadahead(struct inode *ip, uint bn, int n)
+{
+  uint addr;
+  int i;
+
+  for(i = 0; i < n && (bn + i) * BSIZE < ip->size; i++){
+    // blocks below ip->size exist, so bmap() won't allocate.
+    if((addr = bmap(ip, bn + i)) == 0)
+      break;
+    if(breadahead(ip->dev, addr) < 0)
+      break;
+  }
+  bkick();
+  return i;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -512,6 +948,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->nexec > 0)
+    return -1;  // a running program; see exec().
+
+  textinval(ip);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -553,10 +993,15 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  // the cache does not know where entries are.
+  if(poff == 0 && dcget(dp, name, &ip))
+    return ip;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1012,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcput(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcput(dp, name, 0);
   return 0;
 }
 
@@ -601,6 +1048,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcput(dp, name, inum);
 
   return 0;
 }
@@ -659,6 +1107,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // only directories have cached entries, so a hit
+    // needs no lock on ip.
+    if(!(nameiparent && *path == '\0') && dcget(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
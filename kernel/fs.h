@@ -20,13 +20,17 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint nfree;        // Number of free data blocks
+  uint nifree;       // Number of free inodes
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 9
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NLEVEL 3   // singly, doubly and triply indirect blocks
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + \
+                 NINDIRECT*NINDIRECT*NINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,9 +39,26 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  ushort flags;         // I_EXTENT
+  ushort pad;
+  uint addrs[NDIRECT+NLEVEL];   // Data block addresses, or extents
 };
 
+// Inode flags
+#define I_EXTENT 0x1  // data mapped by extents, not by block addresses
+
+// A run of contiguous data blocks of an I_EXTENT file.
+// Its addrs[] holds NIEXTENT extents, in file order, then
+// the address of a block holding NXEXTENT more.
+struct extent {
+  uint start;   // first disk block
+  uint len;     // number of blocks; 0 if unused
+};
+
+#define NIEXTENT ((NDIRECT+NLEVEL-1) / 2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+#define EXTBLOCK (NIEXTENT*2)  // addrs[] index of the extent block
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -50,6 +71,15 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Most blocks each kind of FS operation writes, which
+// begin_op() reserves in the log. Freeing a file's blocks
+// may write every bitmap block. A write of up to NINDIRECT
+// blocks changes at most two indirect blocks at each level.
+// Any allocation or free also writes the superblock's counts.
+#define OPBLOCKS_IPUT  (FSSIZE/BPB + 3)               // iput(): bitmap, inode, super
+#define OPBLOCKS_DIR   (MAXOPBLOCKS + OPBLOCKS_IPUT)  // create, link, unlink
+#define OPBLOCKS_WRITE(n) (2*((n)/BSIZE + 2) + 4*NLEVEL + 2)  // writei() of n bytes
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -1,6 +1,23 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// The global pool is a buddy allocator: a free block of
+// 2^k pages is aligned to its size, and when it is freed
+// it is merged with its buddy (the other half of the
+// enclosing 2^(k+1) block) if that is free too.
+//
+// Each hart also keeps its own list of free single pages,
+// so that kalloc() and kfree() normally take only that
+// hart's lock. Pages move between a hart's list and the
+// buddy pool KBATCH at a time. A hart whose list and the
+// pool are both empty steals half of another hart's list.
+//
+// Every allocated page has a reference count, so that
+// copy-on-write fork can share a page between processes.
+// kalloc() sets it to one, kref() adds a reference, and
+// kfree() only frees the page when the last one is dropped.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +26,14 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH  32          // pages moved to/from the global pool at once
+#define KHIGH   (4*KBATCH)  // a hart spills KBATCH pages beyond this many
+#define KRECLAIM 16         // pages to ask the buffer cache for when out
+
+#define NPAGE   ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PAGENO(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define NOTFREE 0xff        // pgorder[] of a page that heads no free block
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +43,40 @@ struct run {
   struct run *next;
 };
 
-struct {
+// a free block in the buddy pool.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct kcpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1];  // circular lists of free blocks, per order
+  int nblock[MAXORDER+1];         // length of each list
+  uchar pgorder[NPAGE];           // order of the free block a page heads
+  int ref[NPAGE];                 // references to each allocated page
+  struct kcpu cpu[NCPU];
 } kmem;
 
+static void buddy_free(uint64 pa, int order);
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
+  for(int k = 0; k <= MAXORDER; k++){
+    kmem.free[k].next = &kmem.free[k];
+    kmem.free[k].prev = &kmem.free[k];
+  }
+  memset(kmem.pgorder, NOTFREE, sizeof(kmem.pgorder));
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,8 +85,190 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddy_free((uint64)p, 0);
+  release(&kmem.lock);
+}
+
+static void
+block_remove(struct block *b, int order)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kmem.nblock[order]--;
+  kmem.pgorder[PAGENO(b)] = NOTFREE;
+}
+
+static void
+block_insert(struct block *b, int order)
+{
+  struct block *h = &kmem.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  kmem.nblock[order]++;
+  kmem.pgorder[PAGENO(b)] = order;
+}
+
+// Take a block of 2^order pages from the buddy pool,
+// splitting a larger block if necessary.
+// Caller must hold kmem.lock.
+static uint64
+buddy_alloc(int order)
+{
+  struct block *b;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(kmem.nblock[k] > 0)
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  b = kmem.free[k].next;
+  block_remove(b, k);
+  // return the upper halves to the pool.
+  while(k > order){
+    k--;
+    block_insert((struct block*)((uint64)b + ((uint64)PGSIZE << k)), k);
+  }
+  return (uint64)b;
+}
+
+// Return a block of 2^order pages to the buddy pool,
+// merging it with its buddy for as long as the buddy is free.
+// Caller must hold kmem.lock.
+static void
+buddy_free(uint64 pa, int order)
+{
+  uint64 buddy;
+
+  while(order < MAXORDER){
+    buddy = pa ^ ((uint64)PGSIZE << order);
+    if(buddy < PGROUNDUP((uint64)end) || buddy >= PHYSTOP)
+      break;
+    if(kmem.pgorder[PAGENO(buddy)] != order)
+      break;
+    block_remove((struct block*)buddy, order);
+    if(buddy < pa)
+      pa = buddy;
+    order++;
+  }
+  block_insert((struct block*)pa, order);
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain; *np is set to its length.
+static struct run*
+detach(struct run **list, int n, int *np)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0){
+    *np = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *np = i;
+  return head;
+}
+
+// Append a chain of pages to *list.
+static void
+splice(struct run **list, struct run *chain)
+{
+  struct run *r;
+
+  for(r = chain; r->next; r = r->next)
+    ;
+  r->next = *list;
+  *list = chain;
+}
+
+// Give a chain of single pages back to the buddy pool.
+static void
+spill(struct run *chain)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(chain){
+    r = chain;
+    chain = r->next;
+    buddy_free((uint64)r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Return every hart's cached pages to the buddy pool,
+// so that they can be merged into larger blocks.
+static void
+kdrain(void)
+{
+  struct run *chain;
+  int n;
+
+  for(int i = 0; i < NCPU; i++){
+    struct kcpu *kc = &kmem.cpu[i];
+    acquire(&kc->lock);
+    chain = detach(&kc->freelist, kc->nfree, &n);
+    kc->nfree -= n;
+    release(&kc->lock);
+    spill(chain);
+  }
+}
+
+// This hart's list is empty: take a batch from the
+// buddy pool, or failing that, half of some other
+// hart's list. Returns one page, and puts the rest
+// of the batch on this hart's list.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *chain, *r;
+  uint64 pa;
+  int n, i;
+
+  chain = 0;
+  acquire(&kmem.lock);
+  for(n = 0; n < KBATCH && (pa = buddy_alloc(0)) != 0; n++){
+    r = (struct run*)pa;
+    r->next = chain;
+    chain = r;
+  }
+  release(&kmem.lock);
+
+  for(i = 1; chain == 0 && i < NCPU; i++){
+    struct kcpu *victim = &kmem.cpu[(id + i) % NCPU];
+    if(victim->nfree == 0)  // unlocked peek; rechecked below.
+      continue;
+    acquire(&victim->lock);
+    chain = detach(&victim->freelist, (victim->nfree + 1) / 2, &n);
+    victim->nfree -= n;
+    release(&victim->lock);
+  }
+
+  if(chain == 0)
+    return 0;
+
+  if(chain->next){
+    struct kcpu *kc = &kmem.cpu[id];
+    acquire(&kc->lock);
+    splice(&kc->freelist, chain->next);
+    kc->nfree += n - 1;
+    release(&kc->lock);
+  }
+  return chain;
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -46,37 +278,251 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain;
+  struct kcpu *kc;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.ref[PAGENO(pa)] <= 0)
+    panic("kfree: ref");
+  if(__sync_sub_and_fetch(&kmem.ref[PAGENO(pa)], 1) > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  chain = 0;
+  if(kc->nfree > KHIGH){
+    chain = detach(&kc->freelist, KBATCH, &n);
+    kc->nfree -= n;
+  }
+  release(&kc->lock);
+
+  if(chain)
+    spill(chain);
+  pop_off();
+}
+
+// Allocate one page from this hart's list, the buddy
+// pool, or another hart's list. Returns 0 if all are empty.
+static struct run*
+kalloc1(void)
+{
+  struct run *r;
+  struct kcpu *kc;
+  int id;
+
+  push_off();
+  id = cpuid();
+  kc = &kmem.cpu[id];
+  acquire(&kc->lock);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When memory runs out, asks the buffer cache to
+// give back some pages before giving up.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  while((r = kalloc1()) == 0)
+    if(bshrink(KRECLAIM) == 0)
+      break;
 
-  if(r)
+  if(r){
+    kmem.ref[PAGENO(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Add a reference to a page returned by kalloc(),
+// which must be freed once more before it is reused.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&kmem.ref[PAGENO(pa)], 1) <= 0)
+    panic("kref: free page");
+}
+
+// Number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kmem.ref[PAGENO(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size; e.g. order 9 is a 2-megabyte block
+// suitable for a megapage mapping.
+// Returns 0 if no block that large is free.
+void *
+kalloc_order(int order)
+{
+  uint64 pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  pa = buddy_alloc(order);
+  release(&kmem.lock);
+  if(pa == 0){
+    // the pages needed to build the block may be
+    // sitting in the per-hart lists.
+    kdrain();
+    acquire(&kmem.lock);
+    pa = buddy_alloc(order);
+    release(&kmem.lock);
+  }
+
+  if(pa){
+    for(int i = 0; i < (1 << order); i++)
+      kmem.ref[PAGENO(pa) + i] = 1;
+    memset((char*)pa, 5, (uint64)PGSIZE << order); // fill with junk
+  }
+  return (void*)pa;
+}
+
+// Free a block returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  for(int i = 0; i < (1 << order); i++)
+    kmem.ref[PAGENO(pa) + i] = 0;
+  memset(pa, 1, (uint64)PGSIZE << order);
+
+  acquire(&kmem.lock);
+  buddy_free((uint64)pa, order);
+  release(&kmem.lock);
+}
+
+// Number of free pages, in the buddy pool and the
+// per-hart lists.
+uint64
+kfreepages(void)
+{
+  uint64 n = 0;
+
+  acquire(&kmem.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    n += (uint64)kmem.nblock[k] << k;
+  release(&kmem.lock);
+  for(int i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].nfree;
+  return n;
+}
+
+// Check the buddy allocator at boot, before anything else
+// uses it: allocate and free blocks of every order, break a
+// large block up into single pages on this hart's list, then
+// take every MAXORDER block there is, which needs kdrain() to
+// rebuild that one. Afterwards the pool must be as it began.
+void
+kcheck(void)
+{
+  uint64 n0, big0, pa, nbig;
+  void *blk[MAXORDER+1], *list;
+  int k;
+
+  kdrain();
+  n0 = kfreepages();
+  big0 = kmem.nblock[MAXORDER];
+
+  for(k = 0; k <= MAXORDER; k++){
+    if((blk[k] = kalloc_order(k)) == 0)
+      panic("kcheck: alloc");
+    if((uint64)blk[k] % ((uint64)PGSIZE << k) != 0)
+      panic("kcheck: alignment");
+  }
+  for(k = 0; k <= MAXORDER; k += 2)
+    kfree_order(blk[k], k);
+  for(k = 1; k <= MAXORDER; k += 2)
+    kfree_order(blk[k], k);
+
+  // scatter one large block across this hart's list and the pool.
+  if((pa = (uint64)kalloc_order(MAXORDER)) == 0)
+    panic("kcheck: alloc");
+  for(k = 0; k < (1 << MAXORDER); k++)
+    kfree((void*)(pa + (uint64)k * PGSIZE));
+
+  list = 0;
+  for(nbig = 0; (pa = (uint64)kalloc_order(MAXORDER)) != 0; nbig++){
+    *(void**)pa = list;
+    list = (void*)pa;
+  }
+  if(nbig != big0)
+    panic("kcheck: lost a block");
+  while(list){
+    pa = (uint64)list;
+    list = *(void**)pa;
+    kfree_order((void*)pa, MAXORDER);
+  }
+
+  kdrain();
+  if(kfreepages() != n0 || kmem.nblock[MAXORDER] != big0)
+    panic("kcheck: pages not merged");
+}
+
+// Print free memory by block size, for debugging.
+// Runs when user types ^P on console.
+// The fragmentation figure is the percentage of free pages
+// that could not be handed out as part of a 2-megabyte block.
+void
+kmemdump(void)
+{
+  uint64 total, cached, large;
+  int k, i;
+
+  total = large = 0;
+  printf("buddy:");
+  for(k = 0; k <= MAXORDER; k++){
+    printf(" %d", kmem.nblock[k]);
+    total += (uint64)kmem.nblock[k] << k;
+    if(k >= MEGAORDER)
+      large += (uint64)kmem.nblock[k] << k;
+  }
+  cached = 0;
+  for(i = 0; i < NCPU; i++)
+    cached += kmem.cpu[i].nfree;
+  printf("\nfree pages %ld (%ld cached per-hart), fragmentation %ld%%\n",
+         total + cached, cached,
+         total + cached ? 100 - large * 100 / (total + cached) : 0);
+}
@@ -15,11 +15,30 @@
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// A system call should call begin_op(n)/end_op() to mark
+// its start and end, where n is the most blocks it can write
+// (see OPBLOCKS_* in fs.h). Usually begin_op() just adds n to
+// the log space reserved by the open transaction and returns.
+// But if the log might run out, it sleeps until the log
+// thread has made room.
+//
+// mkfs chooses the size of the log; no operation may reserve
+// more than half of it.
+//
+// Commits are done by a kernel process, the log thread.
+// When the last outstanding end_op() finishes, the thread
+// copies the transaction's blocks into log buffers, lets new
+// system calls start a new transaction, and then writes the
+// log blocks and the header. end_op() returns once its
+// transaction is on disk. System calls that start while a
+// commit is being written all go into the next commit.
+//
+// Committed blocks are not copied to their home locations
+// (installed) right away: the log keeps growing with each
+// commit, and the cache keeps the blocks pinned, until a
+// commit leaves too little room for the largest operation.
+// Then the thread installs the whole log and empties it,
+// while no system call runs.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +47,8 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A block that several transactions wrote is in the log
+// several times; the last copy wins.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,14 +62,19 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // log thread is sealing a transaction, please wait.
+  int txstart;     // lh.block[txstart..n) is the open transaction.
+  int reserved;    // blocks reserved by the open transaction's ops.
+  int seq;         // number of the open transaction.
+  int done;        // transactions before this one are on disk.
   int dev;
   struct logheader lh;
+  struct buf *buf[LOGSIZE]; // the log thread's buffers
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logthread(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,24 +86,53 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  if (log.size - 1 > LOGSIZE)
+    panic("initlog: log too big");
+  if (logopmax() < OPBLOCKS_DIR)
+    panic("initlog: log too small");
   recover_from_log();
+  kproc("log", logthread);
+}
+
+// Is lh.block[i] the last copy of its block in the log?
+static int
+lastcopy(int i)
+{
+  for (int j = i + 1; j < log.lh.n; j++)
+    if (log.lh.block[j] == log.lh.block[i])
+      return 0;
+  return 1;
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// The cache holds the latest committed copy of each one,
+// unless we are recovering after a crash.
 static void
 install_trans(int recovering)
 {
-  int tail;
+  struct buf **dbuf = log.buf;
+  int tail, n = 0;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
+    struct buf *b = bread(log.dev, log.lh.block[tail]); // read dst
     if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+      bunpin(b);
+    if(!lastcopy(tail)){
+      brelse(b);
+      continue;
+    }
+    if(recovering){
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      memmove(b->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bwrite_async(b);  // start writing dst to disk
+    dbuf[n++] = b;
+  }
+  // the disk may finish the writes in any order.
+  for (tail = 0; tail < n; tail++) {
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -96,17 +150,17 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the first n entries of the in-memory log header
+// to disk. This is the true point at which the
+// transactions they hold commit.
 static void
-write_head(void)
+write_head(int n)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
+  hb->n = n;
+  for (i = 0; i < n; i++) {
     hb->block[i] = log.lh.block[i];
   }
   bwrite(buf);
@@ -119,22 +173,34 @@ recover_from_log(void)
   read_head();
   install_trans(1); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(0); // clear the log
 }
 
-// called at the start of each FS system call.
+// The most blocks one FS operation may reserve.
+int
+logopmax(void)
+{
+  return (log.size - 1) / 2;
+}
+
+// called at the start of each FS system call,
+// which will write at most n blocks.
 void
-begin_op(void)
+begin_op(int n)
 {
+  if(n > logopmax())
+    panic("begin_op: too big");
+
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.txstart + log.reserved + n > log.size - 1){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
@@ -142,69 +208,121 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, asks the
+// log thread to commit. waits until this operation's
+// writes, if any, are on disk.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  int seq;
 
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+  if(log.lh.n > log.txstart){
+    seq = log.seq;
+    if(log.outstanding == 0){
+      log.committing = 1;
+      wakeup(&log.committing);
+    }
+    while(log.done <= seq)
+      sleep(&log.done, &log.lock);
+  } else if(log.outstanding == 0){
+    // nothing to commit; the ops' reservations are free.
+    log.reserved = 0;
     wakeup(&log);
   }
   release(&log.lock);
-
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the open transaction, lh.block[start..n),
+// from the cache into locked log buffers in to[].
+// No system call may be running.
 static void
-write_log(void)
+seal(struct buf **to, int start, int n)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+  for (tail = start; tail < n; tail++) {
+    to[tail-start] = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    memmove(to[tail-start]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the log buffers that seal() filled to disk.
 static void
-commit()
+write_log(struct buf **to, int n)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int tail;
+
+  for (tail = 0; tail < n; tail++)
+    bwrite_async(to[tail]);  // start writing the log
+  // all of the log must be on disk before write_head().
+  for (tail = 0; tail < n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
+  }
+}
+
+// The log thread: commits each transaction that end_op()
+// hands it, and installs the log when it is nearly full.
+static void
+logthread(void)
+{
+  struct buf **to = log.buf;
+  int start, n, seq, install;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!log.committing)
+      sleep(&log.committing, &log.lock);
+    start = log.txstart;
+    n = log.lh.n;
+    seq = log.seq++;
+    log.reserved = 0;
+    // install if the largest operation might not fit.
+    install = n + logopmax() > log.size - 1;
+    release(&log.lock);
+
+    seal(to, start, n);
+
+    if(!install){
+      // new system calls may now change the cache;
+      // the log buffers hold what this commit writes.
+      acquire(&log.lock);
+      log.txstart = n;
+      log.committing = 0;
+      wakeup(&log);
+      release(&log.lock);
+    }
+
+    write_log(to, n - start);  // Write modified blocks to log
+    write_head(n);             // Write header to disk -- the real commit
+
+    acquire(&log.lock);
+    log.done = seq + 1;
+    wakeup(&log.done);
+    if(install){
+      release(&log.lock);
+      // no system call has run since seal(), so the
+      // cache holds exactly what the log does.
+      install_trans(0);        // Now install writes to home locations
+      log.lh.n = 0;
+      write_head(0);           // Erase the transactions from the log
+      acquire(&log.lock);
+      log.txstart = 0;
+      log.committing = 0;
+      wakeup(&log);
+    }
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log thread will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,17 +335,17 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
+  for (i = log.txstart; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    if (log.lh.n >= log.size - 1 || log.lh.n - log.txstart >= log.reserved)
+      panic("too big a transaction");
+    log.lh.block[i] = b->blockno;
     bpin(b);
     log.lh.n++;
   }
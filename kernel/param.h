@@ -1,15 +1,23 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         4  // scheduling priority levels
+#define BOOSTTICKS   20  // clock ticks between scheduling priority boosts
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // memory mappings per process
+#define NINODE       50  // minimum number of cached unused i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // max # of blocks a directory FS op writes
+#define LOGSIZE      254 // max data blocks in on-disk log
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS)  // minimum size of disk block cache
+#ifndef BCACHEPCT
+#define BCACHEPCT    6     // percent of free memory for the disk block cache
+#endif
+#define ICACHEPCT    1     // percent of free memory for unused cached i-nodes
+#define FSSIZE       100000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define MAXORDER     10    // largest kalloc_order() block is 2^MAXORDER pages
+#define MEGAORDER    9     // order of a 2-megabyte megapage
 
@@ -4,6 +4,7 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "fs.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -12,6 +13,8 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+uint boostgen;  // number of schedboost()s so far
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
@@ -20,11 +23,26 @@ static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
-// helps ensure that wakeups of wait()ing
-// parents are not lost. helps obey the
-// memory model when using p->parent.
-// must be acquired before any p->lock.
-struct spinlock wait_lock;
+// Wait queues. A SLEEPING process is on the queue that its
+// p->chan hashes to, so wakeup() need only look at processes
+// sleeping on channels with the same hash. A queue's lock is
+// taken before the p->lock of any process on it.
+#define NSLEEPQ 61
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;    // linked through p->sqnext
+} sleepq[NSLEEPQ];
+
+#define SQHASH(chan) (&sleepq[((uint64)(chan) / 8) % NSLEEPQ])
+
+// Each process keeps lists of its children: those still
+// running, and zombies waiting for wait(). p->wlock protects
+// p's lists and the parent and list links of p's children,
+// and ensures that wakeups of wait()ing parents are not lost.
+// A child's exit() takes its parent's wlock, which is held
+// before any p->lock. When two are needed, a process's wlock
+// comes before initproc's.
 
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
@@ -50,9 +68,13 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rqlock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initlock(&p->wlock, "wait");
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
   }
@@ -124,6 +146,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->boost = boostgen;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -164,10 +190,13 @@ freeproc(struct proc *p)
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
+  p->sibnext = 0;
+  p->sibprevp = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -228,6 +257,229 @@ uchar initcode[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+// Run queues.
+//
+// Each cpu has FIFO queues of RUNNABLE processes, so that
+// scheduler() need not look at every process. A process that
+// becomes RUNNABLE joins a queue of the cpu it last ran on
+// (p->cpu), where its data may still be cached; a new one
+// joins its parent's. A cpu whose queues are empty takes a
+// process from the busiest other cpu.
+//
+// The queues form a multi-level feedback queue: there is one
+// for each priority level p->prio, and a cpu runs the first
+// process of its highest non-empty level. A process that uses
+// up its quantum, QUANTUM(p->prio) clock ticks, drops a level,
+// and one that sleeps first keeps its level, so interactive
+// processes stay above CPU-bound ones. A process that waits
+// for a higher one preempts the running process at the next
+// tick. Every BOOSTTICKS ticks, schedboost() moves every
+// process back to its top level, p->nice, so none starves.
+//
+// A process is on a queue exactly when it is RUNNABLE. The
+// cpu that takes it off the queue is the only one that may
+// run it, and does so after acquiring p->lock; so a process
+// that yield()ed, and is taken by another cpu before it has
+// switched away, is not run until the switch is done.
+// p->lock protects p->prio, p->slice and p->boost, except
+// that schedboost() changes them, under the queue's rqlock,
+// while p is on a queue.
+// Lock order: p->lock, then a queue's rqlock.
+
+#define QUANTUM(prio)  (1 << (prio))  // ticks
+
+// Append p to c's queue for level p->prio.
+// Caller must hold c->rqlock.
+static void
+runq_append(struct cpu *c, struct proc *p)
+{
+  p->rqnext = 0;
+  if(c->rqtail[p->prio])
+    c->rqtail[p->prio]->rqnext = p;
+  else
+    c->rqhead[p->prio] = p;
+  c->rqtail[p->prio] = p;
+}
+
+// Bring p's level up to date with boosts and nice().
+// Caller must hold p->lock.
+static void
+prioupdate(struct proc *p)
+{
+  if(p->boost != boostgen){
+    p->boost = boostgen;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+  if(p->prio < p->nice){
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+}
+
+// Return an idle cpu, or 0.
+static struct cpu*
+idlecpu(void)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    if(c->idle)
+      return c;
+  return 0;
+}
+
+// Mark p RUNNABLE and put it on a run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+  int idle;
+
+  p->state = RUNNABLE;
+  prioupdate(p);
+  acquire(&c->rqlock);
+  runq_append(c, p);
+  c->nrq++;
+  idle = c->idle;
+  release(&c->rqlock);
+
+  // wake c if it is idle, and otherwise an idle cpu,
+  // if there is one, to take p from c.
+  if(!idle)
+    c = idlecpu();
+  if(c && c != mycpu())
+    ipi(c - cpus);
+}
+
+// Take the first process of c's highest non-empty level, or 0.
+static struct proc*
+runq_pop(struct cpu *c)
+{
+  struct proc *p = 0;
+  int i;
+
+  acquire(&c->rqlock);
+  for(i = 0; i < NPRIO; i++){
+    if((p = c->rqhead[i]) != 0){
+      c->rqhead[i] = p->rqnext;
+      if(c->rqhead[i] == 0)
+        c->rqtail[i] = 0;
+      c->nrq--;
+      break;
+    }
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// Charge the current process for a clock tick. Returns 1 if
+// it should yield the cpu: it has used up its quantum, and so
+// has dropped a level, or a process at a higher level is
+// waiting for this cpu.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  int i, r = 0;
+
+  acquire(&p->lock);
+  prioupdate(p);
+  if(++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    r = 1;
+  }
+  c = mycpu();
+  for(i = 0; i < p->prio; i++)
+    if(c->rqhead[i])
+      r = 1;
+  release(&p->lock);
+  return r;
+}
+
+// Move every process back to its top level. Processes not on
+// a run queue catch up when they next join one or take a tick.
+// Called by clockintr() every BOOSTTICKS ticks.
+void
+schedboost(void)
+{
+  struct proc *p, *next;
+  struct cpu *c;
+  int i;
+
+  __sync_fetch_and_add(&boostgen, 1);
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->nrq == 0)
+      continue;
+    acquire(&c->rqlock);
+    for(i = 1; i < NPRIO; i++){
+      p = c->rqhead[i];
+      c->rqhead[i] = c->rqtail[i] = 0;
+      for(; p; p = next){
+        next = p->rqnext;
+        p->boost = boostgen;
+        p->prio = p->nice;
+        p->slice = 0;
+        runq_append(c, p);
+      }
+    }
+    release(&c->rqlock);
+  }
+}
+
+// Set the nice value, the highest priority level allowed, of
+// process pid, or of the caller if pid is 0.
+// Returns the old value, or -1.
+int
+setnice(int pid, int nice)
+{
+  struct proc *p;
+  int old;
+
+  if(nice < 0 || nice >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->nice;
+      p->nice = nice;  // p->prio follows in prioupdate().
+      release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Find a process for cpu c to run: the next one on its own
+// queues, or else one from the busiest other cpu.
+static struct proc*
+runq_take(struct cpu *c)
+{
+  struct cpu *busiest;
+  struct proc *p;
+  int i;
+
+  if(c->nrq > 0 && (p = runq_pop(c)) != 0)
+    return p;
+  busiest = 0;
+  for(i = 0; i < NCPU; i++)
+    if(&cpus[i] != c && cpus[i].nrq > 0 &&
+       (busiest == 0 || cpus[i].nrq > busiest->nrq))
+      busiest = &cpus[i];
+  if(busiest && (p = runq_pop(busiest)) != 0){
+    c->nsteal++;
+    return p;
+  }
+  return 0;
+}
+
 // Set up first user process.
 void
 userinit(void)
@@ -249,12 +501,42 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// A kernel process starts here, the first time
+// the scheduler runs it.
+static void
+kprocstart(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kproc returned");
+}
 
+// Start a kernel process that runs fn(), which must never
+// return. It has no user memory and never enters user space.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; each new page is allocated
+// and zeroed by vmfault() when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,9 +546,9 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > vmabase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -274,6 +556,43 @@ growproc(int n)
   return 0;
 }
 
+// Add child c to list *head of its parent.
+// Caller must hold the parent's wlock.
+static void
+sib_insert(struct proc **head, struct proc *c)
+{
+  c->sibnext = *head;
+  c->sibprevp = head;
+  if(*head)
+    (*head)->sibprevp = &c->sibnext;
+  *head = c;
+}
+
+// Remove child c from its parent's list.
+// Caller must hold the parent's wlock.
+static void
+sib_remove(struct proc *c)
+{
+  *c->sibprevp = c->sibnext;
+  if(c->sibnext)
+    c->sibnext->sibprevp = c->sibprevp;
+}
+
+// Move the processes on list *from to list *to, making
+// them children of init.
+// Caller must hold both lists' wlocks.
+static void
+sib_adopt(struct proc **from, struct proc **to)
+{
+  struct proc *c;
+
+  while((c = *from) != 0){
+    sib_remove(c);
+    c->parent = initproc;
+    sib_insert(to, c);
+  }
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int
@@ -296,6 +615,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Share memory mappings with the child.
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -314,30 +640,34 @@ fork(void)
 
   release(&np->lock);
 
-  acquire(&wait_lock);
+  acquire(&p->wlock);
   np->parent = p;
-  release(&wait_lock);
+  sib_insert(&p->children, np);
+  release(&p->wlock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = cpuid();
+  np->nice = p->nice;
+  np->prio = p->nice;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
 // Pass p's abandoned children to init.
-// Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  acquire(&p->wlock);
+  if(p->children || p->zombies){
+    acquire(&initproc->wlock);
+    sib_adopt(&p->children, &initproc->children);
+    sib_adopt(&p->zombies, &initproc->zombies);
+    wakeup(initproc);
+    release(&initproc->wlock);
   }
+  release(&p->wlock);
 }
 
 // Exit the current process.  Does not return.
@@ -347,10 +677,14 @@ void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct proc *pp;
 
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and remove memory mappings.
+  vmafree(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -360,25 +694,35 @@ exit(int status)
     }
   }
 
-  begin_op();
+  begin_op(OPBLOCKS_IPUT);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
 
-  acquire(&wait_lock);
-
   // Give any children to init.
   reparent(p);
 
+  // Lock the parent's lists. The parent may be exiting too,
+  // and giving p to init, until we hold its wlock.
+  for(;;){
+    pp = p->parent;
+    acquire(&pp->wlock);
+    if(p->parent == pp)
+      break;
+    release(&pp->wlock);
+  }
+
   // Parent might be sleeping in wait().
-  wakeup(p->parent);
+  wakeup(pp);
   
   acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
+  sib_remove(p);
+  sib_insert(&pp->zombies, p);
 
-  release(&wait_lock);
+  release(&pp->wlock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -391,47 +735,70 @@ int
 wait(uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int pid;
   struct proc *p = myproc();
 
-  acquire(&wait_lock);
+  // the status is copied out with spinlocks held, so fault in
+  // its page first; see uvmprefault().
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int), 1);
+
+  acquire(&p->wlock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
-          release(&pp->lock);
-          release(&wait_lock);
-          return pid;
-        }
+    if((pp = p->zombies) != 0){
+      // Found one.
+      sib_remove(pp);
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+      pid = pp->pid;
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                              sizeof(pp->xstate)) < 0) {
+        sib_insert(&p->zombies, pp);
         release(&pp->lock);
+        release(&p->wlock);
+        return -1;
       }
+      freeproc(pp);
+      release(&pp->lock);
+      release(&p->wlock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || killed(p)){
-      release(&wait_lock);
+    if(p->children == 0 || killed(p)){
+      release(&p->wlock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &wait_lock);  //DOC: wait-sleep
+    sleep(p, &p->wlock);  //DOC: wait-sleep
+  }
+}
+
+// Nothing to run on c: stop until an interrupt. The timer is
+// set only for the next sleep() deadline, so an idle cpu takes
+// no clock ticks; setrunnable() sends c an ipi() when there is
+// work for it. c->idle is set under c->rqlock, so that
+// setrunnable() cannot queue a process after c has found its
+// queues empty without also seeing that c is idle.
+static void
+cpuidle(struct cpu *c)
+{
+  intr_off();
+  acquire(&c->rqlock);
+  c->idle = c->nrq == 0;
+  release(&c->rqlock);
+  if(c->idle){
+    c->nidle++;
+    timerset(0);
+    // wfi returns once an interrupt is pending, even with
+    // interrupts off; intr_on() below takes it.
+    asm volatile("wfi");
+    c->idle = 0;
+    clockupdate();
   }
+  intr_on();
 }
 
 // Per-CPU process scheduler.
@@ -454,29 +821,27 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      intr_on();
-      asm volatile("wfi");
+    if((p = runq_take(c)) == 0){
+      cpuidle(c);
+      continue;
     }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = c - cpus;
+    c->proc = p;
+    timerset(1);
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -513,7 +878,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -548,20 +913,25 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = SQHASH(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's wait queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the queue),
   // so it's okay to release lk.
 
+  acquire(&sq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -578,17 +948,58 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  struct sleepq *sq = SQHASH(chan);
+  struct proc *p, **pp;
+
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0; ){
+    // p->chan does not change while p is on the queue.
+    if(p->chan == chan){
+      *pp = p->sqnext;
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      setrunnable(p);
       release(&p->lock);
+    } else {
+      pp = &p->sqnext;
     }
   }
+  release(&sq->lock);
+}
+
+// Wake up p, if it is sleeping, whatever it sleeps on.
+// Must be called without any p->lock.
+static void
+unsleep(struct proc *p)
+{
+  struct sleepq *sq;
+  struct proc **pp;
+  void *chan;
+
+  for(;;){
+    acquire(&p->lock);
+    if(p->state != SLEEPING){
+      release(&p->lock);
+      return;
+    }
+    chan = p->chan;
+    release(&p->lock);
+
+    // the queue lock comes first, so check again.
+    sq = SQHASH(chan);
+    acquire(&sq->lock);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+        ;
+      *pp = p->sqnext;
+      setrunnable(p);
+      release(&p->lock);
+      release(&sq->lock);
+      return;
+    }
+    release(&p->lock);
+    release(&sq->lock);
+  }
 }
 
 // Kill the process with the given pid.
@@ -603,11 +1014,9 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
       release(&p->lock);
+      // Wake process from sleep().
+      unsleep(p);
       return 0;
     }
     release(&p->lock);
@@ -692,4 +1101,8 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  for(int i = 0; i < NCPU; i++)
+    if(cpus[i].nrq || cpus[i].nsteal || cpus[i].nidle)
+      printf("cpu %d: %d queued, %ld stolen, %ld idle\n", i, cpus[i].nrq,
+             cpus[i].nsteal, cpus[i].nidle);
 }
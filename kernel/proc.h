@@ -24,6 +24,16 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  // run queues of RUNNABLE processes waiting for this cpu,
+  // one per priority level.
+  struct spinlock rqlock;     // protects the fields below
+  struct proc *rqhead[NPRIO]; // linked through p->rqnext
+  struct proc *rqtail[NPRIO];
+  int nrq;                    // length of all the queues
+  int idle;                   // waiting in wfi for work; see cpuidle()
+  uint64 nsteal;              // processes taken from other cpus' queues
+  uint64 nidle;               // times gone idle
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +89,17 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A memory mapping made by mmap(); see vma.c.
+struct vma {
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // bytes, a multiple of PGSIZE; 0 if unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // mapped file, or 0 for anonymous memory
+  uint64 off;                  // file offset of addr
+  uint64 filesz;               // bytes backed by the file; the rest is zero
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -91,9 +112,27 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Run queue to join when RUNNABLE
+  int nice;                    // Highest priority level allowed
+  int prio;                    // Priority level, 0 is highest
+  int slice;                   // Ticks used at this level
+  uint boost;                  // Value of boostgen when prio was set
 
-  // wait_lock must be held when using this:
+  // the run queue's rqlock must be held when using this:
+  struct proc *rqnext;         // Next process on the run queue
+
+  // the wait queue's lock must be held when using this:
+  struct proc *sqnext;         // Next process sleeping in the wait queue
+
+  // the parent's wlock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *sibnext;        // Next on the parent's children or zombies
+  struct proc **sibprevp;      // What points to this process on that list
+
+  // wlock must be held when using these:
+  struct spinlock wlock;       // Also the lock wait() sleeps with
+  struct proc *children;       // Children that have not exited
+  struct proc *zombies;        // Exited children not yet waited for
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -102,6 +141,8 @@ struct proc {
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // Memory mappings
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Kernel process: what it runs
 };
@@ -0,0 +1,234 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A cache hands out objects of one size, carved from
+// whole pages obtained with kalloc(). Each page (a slab)
+// starts with a struct slab header, followed by as many
+// objects as fit. The free objects of a slab are kept on
+// a list threaded through the objects themselves.
+//
+// Each hart keeps a magazine of free objects per cache,
+// so that most allocations and frees touch no lock at all.
+// A hart refills an empty magazine from the cache's slabs,
+// and flushes half of a full magazine back to them.
+//
+// New slabs are allocated with no cache lock held: kalloc()
+// may call bshrink(), which takes the buffer cache's locks,
+// and those come after every lock held around a kalloc().
+//
+// Interface:
+// * kmem_cache_create(name, size) makes a cache at boot.
+// * kmem_cache_alloc(c) returns an uninitialized object, or 0.
+// * kmem_cache_free(c, obj) gives it back.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE   16  // maximum number of caches
+#define MAGSIZE  16  // free objects a hart keeps per cache
+
+struct slab {
+  struct slab *next;   // list of slabs with free objects
+  struct slab *prev;
+  void *freelist;      // free objects in this slab
+  int inuse;           // objects handed out, counting magazines
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // bytes per object
+  int perslab;          // objects per slab
+  struct slab partial;  // circular list of slabs with free objects
+  int nslab;            // slabs owned by this cache
+  int nempty;           // slabs with no objects in use
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache cache[NCACHE];
+} slabs;
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Make a cache of objects of the given size.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;   // keep objects 8-byte aligned
+  if(size + sizeof(struct slab) > PGSIZE)
+    panic("kmem_cache_create: too big");
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NCACHE)
+    panic("kmem_cache_create: no caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->partial.next = &c->partial;
+  c->partial.prev = &c->partial;
+  return c;
+}
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+}
+
+// Carve page s into a new slab of free objects for cache c.
+// Caller must hold c->lock.
+static void
+slab_add(struct kmem_cache *c, struct slab *s)
+{
+  char *obj;
+  int i;
+
+  s->freelist = 0;
+  obj = (char*)s + sizeof(struct slab);
+  for(i = 0; i < c->perslab; i++, obj += c->size){
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  s->inuse = 0;
+  slab_link(c, s);
+  c->nslab++;
+  c->nempty++;
+}
+
+// Take one object from the cache's slabs,
+// or return 0 if they are all full.
+// Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  s = c->partial.next;
+  if(s == &c->partial)
+    return 0;
+
+  if(s->inuse == 0)
+    c->nempty--;
+  obj = s->freelist;
+  s->freelist = *(void**)obj;
+  s->inuse++;
+  if(s->freelist == 0)
+    slab_unlink(s);   // slab is full
+  return obj;
+}
+
+// Fill magazine m halfway from the cache's slabs.
+// Caller must hold c->lock.
+static void
+mag_fill(struct kmem_cache *c, struct magazine *m)
+{
+  void *obj;
+
+  while(m->n < MAGSIZE/2 && (obj = slab_get(c)) != 0)
+    m->obj[m->n++] = obj;
+}
+
+// Return one object to its slab. Keeps at most one
+// empty slab around; frees the page of any other.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->freelist == 0)
+    slab_link(c, s);  // was full
+  *(void**)obj = s->freelist;
+  s->freelist = obj;
+  if(--s->inuse == 0){
+    if(c->nempty > 0){
+      slab_unlink(s);
+      c->nslab--;
+      kfree(s);
+    } else {
+      c->nempty++;
+    }
+  }
+}
+
+// Allocate one object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  struct slab *s;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    mag_fill(c, m);
+    release(&c->lock);
+  }
+  if(m->n == 0 && (s = kalloc()) != 0){
+    // every slab is full.
+    acquire(&c->lock);
+    slab_add(c, s);
+    mag_fill(c, m);
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free an object returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(obj == 0 || ((uint64)obj % PGSIZE) < sizeof(struct slab))
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
@@ -10,6 +10,12 @@ void timerinit();
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// scratch space for mvec in kernelvec.S, one per CPU.
+uint64 ipi_scratch[NCPU][2];
+
+// in kernelvec.S, passes ipi()s on to supervisor mode.
+void mvec();
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -44,6 +50,11 @@ start()
   int id = r_mhartid();
   w_tp(id);
 
+  // take machine-mode software interrupts, sent by ipi().
+  w_mscratch((uint64)ipi_scratch[id]);
+  w_mtvec((uint64)mvec);
+  w_mie(r_mie() | MIE_MSIE);
+
   // switch to supervisor mode and jump to main().
   asm volatile("mret");
 }
@@ -129,7 +129,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(OPBLOCKS_DIR);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -196,7 +196,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(OPBLOCKS_DIR);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -222,6 +222,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcput(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -314,7 +315,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_op(OPBLOCKS_DIR);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -341,6 +342,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program's file may not be changed; see exec().
+  if(ip->nexec > 0 && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -359,10 +367,14 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nora = (omode & O_NOREADAHEAD) != 0;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
   }
+  if((omode & O_EXTENT) && ip->type == T_FILE){
+    iextent(ip);
+  }
 
   iunlock(ip);
   end_op();
@@ -376,7 +388,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op(OPBLOCKS_DIR);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -393,7 +405,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op(OPBLOCKS_DIR);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -413,7 +425,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op();
+  begin_op(OPBLOCKS_IPUT);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -474,6 +486,33 @@ sys_exec(void)
   return -1;
 }
 
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
+
 uint64
 sys_pipe(void)
 {
@@ -64,6 +64,7 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
+    tickwait(ticks0 + n);
     sleep(&ticks, &tickslock);
   }
   release(&tickslock);
@@ -79,7 +80,7 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
@@ -91,3 +92,16 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// set the scheduling priority limit of a process (0 for
+// the caller), from 0 (highest) to NPRIO-1, and return the
+// old one.
+uint64
+sys_nice(void)
+{
+  int pid, n;
+
+  argint(0, &pid);
+  argint(1, &n);
+  return setnice(pid, n);
+}
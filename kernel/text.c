@@ -0,0 +1,138 @@
+// Cache of read-only program pages, shared between processes.
+//
+// When a process faults in a page of a read-only file mapping,
+// such as a program's text, vmafault() first looks here for a
+// page already read from the same bytes of the same file, and
+// maps that page instead of reading a private copy. So every
+// process running the same binary shares its text pages.
+//
+// Entries are keyed by (dev, inum, offset, length) and each
+// holds a reference to its page (see kref()), so a page stays
+// cached after the processes mapping it exit. A full cache
+// replaces entries round-robin.
+//
+// Any write to or truncation of a file drops its entries, so
+// processes that exec the file later see the new contents.
+// Both that and fill-in happen with the inode locked, so a
+// stale page cannot be added after the invalidation.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NTEXT      128  // cached pages
+#define NTEXTHASH  31   // hash buckets, keyed by inode
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint off;             // file offset of the page's contents
+  uint n;               // bytes of file data; the rest is zero
+  uint64 pa;            // 0 if the entry is unused
+  struct textpage *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct textpage page[NTEXT];
+  struct textpage *bucket[NTEXTHASH];
+  int hand;             // next entry to replace
+} text;
+
+#define TEXTHASH(dev, inum) (((dev) * 31 + (inum)) % NTEXTHASH)
+
+void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+// Remove entry t from its bucket and drop its page.
+// Caller must hold text.lock.
+static void
+textdrop(struct textpage *t)
+{
+  struct textpage **pp;
+
+  for(pp = &text.bucket[TEXTHASH(t->dev, t->inum)]; *pp; pp = &(*pp)->next){
+    if(*pp == t){
+      *pp = t->next;
+      break;
+    }
+  }
+  kfree((void*)t->pa);
+  t->pa = 0;
+}
+
+// Return the cached page holding n bytes of ip at off,
+// with a reference added for the caller, or 0.
+// Caller must hold ip->lock.
+uint64
+textget(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t;
+  uint64 pa = 0;
+
+  acquire(&text.lock);
+  for(t = text.bucket[TEXTHASH(ip->dev, ip->inum)]; t; t = t->next){
+    if(t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n){
+      pa = t->pa;
+      kref((void*)pa);
+      break;
+    }
+  }
+  release(&text.lock);
+  return pa;
+}
+
+// Remember that page pa holds n bytes of ip at off.
+// The cache takes its own reference to pa.
+// Caller must hold ip->lock.
+void
+textput(struct inode *ip, uint off, uint n, uint64 pa)
+{
+  struct textpage *t;
+  int h = TEXTHASH(ip->dev, ip->inum);
+
+  acquire(&text.lock);
+  for(t = text.bucket[h]; t; t = t->next){
+    if(t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n){
+      release(&text.lock);
+      return;
+    }
+  }
+  t = &text.page[text.hand];
+  text.hand = (text.hand + 1) % NTEXT;
+  if(t->pa)
+    textdrop(t);
+  t->dev = ip->dev;
+  t->inum = ip->inum;
+  t->off = off;
+  t->n = n;
+  t->pa = pa;
+  kref((void*)pa);
+  t->next = text.bucket[h];
+  text.bucket[h] = t;
+  release(&text.lock);
+}
+
+// ip's contents are about to change: forget its pages.
+// Caller must hold ip->lock.
+void
+textinval(struct inode *ip)
+{
+  struct textpage *t, *next;
+
+  acquire(&text.lock);
+  for(t = text.bucket[TEXTHASH(ip->dev, ip->inum)]; t; t = next){
+    next = t->next;
+    if(t->dev == ip->dev && t->inum == ip->inum)
+      textdrop(t);
+  }
+  release(&text.lock);
+}
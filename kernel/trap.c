@@ -6,8 +6,13 @@
 #include "proc.h"
 #include "defs.h"
 
+#define TICKCYCLES  1000000  // time CSR cycles per tick, about a tenth of a second
+
 struct spinlock tickslock;
 uint ticks;
+static uint64 time0;     // time CSR at boot, when ticks was 0
+static int sleepers;     // is a sleep() waiting for ticks to reach nextwake?
+static uint nextwake;    // earliest tick a sleep() waits for
 
 extern char trampoline[], uservec[], userret[];
 
@@ -16,10 +21,24 @@ void kernelvec();
 
 extern int devintr();
 
+// The kind of access, PTE_R, PTE_W or PTE_X, that caused
+// a page fault, or 0 if scause is not a page fault.
+static int
+faultaccess(uint64 scause)
+{
+  switch(scause){
+  case 12: return PTE_X;  // instruction page fault
+  case 13: return PTE_R;  // load page fault
+  case 15: return PTE_W;  // store/AMO page fault
+  default: return 0;
+  }
+}
+
 void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  time0 = r_time();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -67,6 +86,11 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && uvmcow(p->pagetable, r_stval()) == 0){
+    // store page fault on a copy-on-write page.
+  } else if(faultaccess(r_scause()) &&
+            vmfault(p->pagetable, r_stval(), faultaccess(r_scause())) != 0){
+    // page fault on a lazily allocated heap page or a mapping.
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -76,8 +100,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt
+  // and the process's turn is over.
+  if(which_dev == 2 && schedtick())
     yield();
 
   usertrapret();
@@ -150,8 +175,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0)
+  // give up the CPU if this is a timer interrupt
+  // and the process's turn is over.
+  if(which_dev == 2 && myproc() != 0 && schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -163,17 +189,72 @@ kerneltrap()
 void
 clockintr()
 {
-  if(cpuid() == 0){
+  clockupdate();
+  timerset(myproc() != 0);
+}
+
+// Bring ticks up to date with the time CSR. Any hart may
+// call it, since an idle hart takes no timer interrupts. Wakes
+// sleep()ers once the earliest of their deadlines has come,
+// and boosts scheduling priorities every BOOSTTICKS ticks.
+void
+clockupdate(void)
+{
+  uint now = (r_time() - time0) / TICKCYCLES;
+  int boost = 0;
+
+  acquire(&tickslock);
+  if((int)(now - ticks) > 0){
+    boost = now / BOOSTTICKS != ticks / BOOSTTICKS;
+    ticks = now;
+    if(sleepers && (int)(ticks - nextwake) >= 0){
+      sleepers = 0;
+      wakeup(&ticks);
+    }
+  }
+  release(&tickslock);
+  if(boost)
+    schedboost();
+}
+
+// Ask clockupdate() to wake the sleep()ers on &ticks when
+// ticks reaches t. Caller must hold tickslock.
+void
+tickwait(uint t)
+{
+  if(!sleepers || (int)(t - nextwake) < 0)
+    nextwake = t;
+  sleepers = 1;
+}
+
+// Ask for the next timer interrupt; this also clears the
+// interrupt request. A hart that is running a process (busy)
+// needs an interrupt at every tick, to charge the process for
+// it and perhaps preempt it. An idle hart needs one only when
+// a sleep()er's deadline comes, and otherwise waits in wfi for
+// a device interrupt or an ipi().
+void
+timerset(int busy)
+{
+  uint64 t;
+
+  if(busy){
+    t = time0 + ((r_time() - time0) / TICKCYCLES + 1) * TICKCYCLES;
+  } else {
     acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
+    t = sleepers ? time0 + (uint64)nextwake * TICKCYCLES : -1;
     release(&tickslock);
   }
+  w_stimecmp(t);
+}
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+// Interrupt hart, to wake it from wfi in scheduler().
+// mvec in kernelvec.S turns the request into a supervisor
+// software interrupt.
+void
+ipi(int hart)
+{
+  *(volatile uint32*)CLINT_MSIP(hart) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -211,6 +292,12 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt: an ipi() from another hart, which
+    // only needs to wake this one. acknowledge it by
+    // clearing the SSIP bit in sip.
+    w_sip(r_sip() & ~2);
+    return 1;
   } else {
     return 0;
   }
@@ -45,9 +45,13 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; the queue
+// is as long as the device allows, up to NUM.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+
+// most blocks in one disk request.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,6 +62,7 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
@@ -4,6 +4,13 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// virtio_disk_start() does not send a buf to the device right
+// away but adds it to a queue sorted by block number. The queue
+// is sent when someone waits for a buf, calls virtio_disk_kick(),
+// or when an interrupt frees descriptors; runs of up to MAXSEG
+// adjacent blocks that are all read or all written go out as a
+// single request.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -22,7 +29,7 @@
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are disk.num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,30 +37,49 @@ static struct disk {
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // disk.num elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are disk.num used ring entries.
   struct virtq_used *used;
 
+  int num;         // queue size negotiated with the device
+  int indirect;    // device takes VIRTIO_RING_F_INDIRECT_DESC?
+
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;       // number of free descriptors
+  uint16 used_idx; // we've looked this far in used[2..num].
+
+  // bufs not yet sent to the device, by block number,
+  // linked through qnext.
+  struct buf *queue;
+  int nqueue;
+
+  // statistics, for virtio_disk_dump().
+  uint64 nreq;     // requests sent to the device
+  uint64 nblock;   // blocks they moved
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b; // first of the request's bufs, linked by qnext
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
+
+  // each request's descriptors, indexed like info[]. if the
+  // device takes indirect descriptors, the request's one ring
+  // descriptor points here; otherwise they are copied into a
+  // chain of ring descriptors.
+  struct virtq_desc table[NUM][MAXSEG+2];
+
   struct spinlock vdisk_lock;
   
 } disk;
@@ -91,8 +117,8 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -114,7 +140,9 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  for(disk.num = NUM; disk.num > max; disk.num /= 2)
+    ;
+  if(disk.num < 3)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
@@ -128,7 +156,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,9 +169,10 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
+  disk.nfree = disk.num;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -156,9 +185,10 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -169,7 +199,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -178,7 +208,7 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
@@ -196,101 +226,212 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate the ring descriptors for a request of n blocks:
+// one, pointing to an indirect table, if the device takes
+// them, else n+2 (they need not be contiguous).
+// returns 0, or -1 if there are not enough free.
 static int
-alloc3_desc(int *idx)
+alloc_req(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  if(!disk.indirect)
+    n += 2;
+  else
+    n = 1;
+  if(disk.nfree < n)
+    return -1;
+  for(int i = 0; i < n; i++)
     idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// fill in the descriptors for a request that moves the n
+// blocks starting at b, linked by qnext and adjacent on the
+// disk, and hand them to the device.
+// caller must hold disk.vdisk_lock.
+static void
+submit(struct buf *b, int n, int *idx)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  struct virtq_desc *t = disk.table[idx[0]];
+  struct buf *x;
+  int i;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, then descriptors
+  // for the data, then one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
-  if(write)
+  if(b->qwrite)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  t[0].addr = (uint64) buf0;
+  t[0].len = sizeof(struct virtio_blk_req);
+  t[0].flags = VRING_DESC_F_NEXT;
+  t[0].next = 1;
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1, x = b; i <= n; i++, x = x->qnext){
+    t[i].addr = (uint64) x->data;
+    t[i].len = BSIZE;
+    if(b->qwrite)
+      t[i].flags = 0; // device reads x->data
+    else
+      t[i].flags = VRING_DESC_F_WRITE; // device writes x->data
+    t[i].flags |= VRING_DESC_F_NEXT;
+    t[i].next = i + 1;
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  t[n+1].addr = (uint64) &disk.info[idx[0]].status;
+  t[n+1].len = 1;
+  t[n+1].flags = VRING_DESC_F_WRITE; // device writes the status
+  t[n+1].next = 0;
+
+  if(disk.indirect){
+    disk.desc[idx[0]].addr = (uint64) t;
+    disk.desc[idx[0]].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+  } else {
+    for(i = 0; i < n + 2; i++){
+      disk.desc[idx[i]] = t[i];
+      if(t[i].flags & VRING_DESC_F_NEXT)
+        disk.desc[idx[i]].next = idx[t[i].next];
+    }
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
+  // record the bufs for virtio_disk_intr().
   disk.info[idx[0]].b = b;
+  disk.nreq++;
+  disk.nblock += n;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  disk.avail->idx += 1; // not % disk.num ...
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// send the queue to the device, as far as free
+// descriptors allow, merging runs of adjacent blocks.
+// caller must hold disk.vdisk_lock.
+static void
+dispatch(void)
+{
+  int idx[MAXSEG+2];
+  struct buf *b, *last;
+  int n, max;
+
+  max = disk.indirect ? MAXSEG : disk.num - 2;
+  if(max > MAXSEG)
+    max = MAXSEG;
+
+  while((b = disk.queue) != 0){
+    last = b;
+    for(n = 1; n < max && last->qnext; n++){
+      if(last->qnext->blockno != last->blockno + 1 ||
+         last->qnext->qwrite != b->qwrite)
+        break;
+      last = last->qnext;
+    }
+    if(alloc_req(idx, n) < 0)
+      break;  // virtio_disk_intr() will call again.
+    disk.queue = last->qnext;
+    disk.nqueue -= n;
+    last->qnext = 0;
+    submit(b, n, idx);
+  }
+}
+
+// add b to the queue, in block order, after any requests for
+// the same block, so that those go to the disk in the order
+// they were made.
+// caller must hold disk.vdisk_lock.
+static void
+enqueue(struct buf *b, int write, void (*done)(struct buf *))
+{
+  struct buf **pp;
+
+  b->disk = 1;
+  b->qwrite = write;
+  b->done = done;
+  for(pp = &disk.queue; *pp && (*pp)->blockno <= b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+  disk.nqueue++;
+}
+
+// Queue b to be read or written, and return without waiting
+// for the disk. b->disk is 1 until the transfer finishes; then
+// virtio_disk_intr() calls done(b), if done is not 0, and wakes
+// up virtio_disk_wait(b). The transfer may not start until
+// someone calls virtio_disk_wait() or virtio_disk_kick().
+void
+virtio_disk_start(struct buf *b, int write, void (*done)(struct buf *))
+{
+  acquire(&disk.vdisk_lock);
+  enqueue(b, write, done);
+  release(&disk.vdisk_lock);
+}
+
+// Like virtio_disk_start(), but returns -1, without queueing
+// anything, if the device is half busy, so that speculative
+// transfers leave room for ones that someone is waiting for.
+int
+virtio_disk_trystart(struct buf *b, int write, void (*done)(struct buf *))
+{
+  acquire(&disk.vdisk_lock);
+  if(disk.nfree < disk.num / 2 || disk.nqueue >= disk.num / 2){
+    release(&disk.vdisk_lock);
+    return -1;
   }
+  enqueue(b, write, done);
+  release(&disk.vdisk_lock);
+  return 0;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Send queued transfers to the device.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  dispatch();
+  release(&disk.vdisk_lock);
+}
 
+// Wait for the transfer started on b to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  dispatch();
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write, 0);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -311,17 +452,39 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].b, *next;
+    disk.info[id].b = 0;
+    free_chain(id);
+
+    for(; b; b = next){
+      // done() may hand b to someone else.
+      next = b->qnext;
+      b->qnext = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->done)
+        b->done(b);
+      wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
 
+  // the freed descriptors can take more of the queue.
+  dispatch();
+
   release(&disk.vdisk_lock);
 }
+
+// Print request merging statistics, for debugging.
+// Runs when user types ^P on console.
+void
+virtio_disk_dump(void)
+{
+  printf("disk: %ld requests, %ld blocks, %ld merged\n",
+         disk.nreq, disk.nblock, disk.nblock - disk.nreq);
+}
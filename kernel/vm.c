@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -30,6 +32,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT software interrupt registers, for ipi()
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
@@ -172,10 +177,11 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. If sparse is set, pages that were never mapped
+// are skipped; otherwise they are a kernel bug.
 // Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+static void
+unmaprange(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int sparse)
 {
   uint64 a;
   pte_t *pte;
@@ -184,10 +190,16 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+    if((pte = walk(pagetable, a, 0)) == 0){
+      if(sparse)
+        continue;
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
+    }
+    if((*pte & PTE_V) == 0){
+      if(sparse)
+        continue;
       panic("uvmunmap: not mapped");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -198,6 +210,25 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// Remove npages of mappings starting from va. va must be
+// page-aligned. The mappings must exist. Optionally free the
+// physical memory.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmaprange(pagetable, va, npages, do_free, 0);
+}
+
+// Like uvmunmap(), but for ranges that are mapped only where
+// they have been touched, such as a lazily grown heap or a
+// memory-mapped region: pages that were never mapped are
+// skipped.
+void
+uvmunmapsparse(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmaprange(pagetable, va, npages, do_free, 1);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -267,7 +298,7 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    uvmunmapsparse(pagetable, PGROUNDUP(newsz), npages, 1);
   }
 
   return newsz;
@@ -299,46 +330,126 @@ void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
   if(sz > 0)
-    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+    uvmunmapsparse(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
+// unmaps any mappings made in new on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages present in old in [va, va+sz) at the same
+// addresses in new, referring to the same physical pages.
+// If cow is set, writable pages are mapped read-only and
+// marked PTE_COW in both page tables; the first store to
+// such a page gives the storing process its own copy (see
+// uvmcow()). Otherwise the pages are shared as they are.
+// returns 0 on success, -1 on failure.
+// unmaps any mappings made in new on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 sz, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = va; i < va + sz; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not yet touched; see vmfault().
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kref((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmapsparse(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a store to a copy-on-write page at va:
+// give the page table a private, writable copy,
+// or just make the page writable if no other page
+// table refers to it any more.
+// returns 0 on success, -1 if va is not a
+// copy-on-write page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers have exited or copied it.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Resolve a page fault at va in the current process for
+// an access of kind PTE_R, PTE_W or PTE_X: fill in a page
+// of a mapping (see vmafault()), or allocate and map a
+// zeroed page if va lies in the heap but was never touched
+// since growproc() lazily extended p->sz over it.
+// returns the page's physical address, or 0 if va is
+// not in the process, already mapped, the access is not
+// allowed, or memory is exhausted.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+
+  if(p == 0 || pagetable != p->pagetable)
+    return 0;
+  if(vmamapped(p, va))
+    return vmafault(p, va, access);
+  if(va >= p->sz || access == PTE_X)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    return 0;
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -366,9 +477,20 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      if(vmfault(pagetable, va0, PTE_W) == 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0)
       return -1;
+    if((*pte & PTE_W) == 0){
+      if(uvmcow(pagetable, va0) != 0)
+        return -1;
+    }
+    // the MMU does not see this store; mark the page dirty
+    // so that a shared mapping writes it back.
+    *pte |= PTE_A|PTE_D;
     pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -382,6 +504,36 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
+// Make the user pages in [va, va+len) present, and private and
+// writable if write is set, as copyout() or copyin() would, so
+// that copying to or from them later needs no page fault.
+// Callers that copy with a lock held, such as fileread(),
+// filewrite(), the pipe and console code and wait(), call this
+// first without the lock, for no more than they will copy:
+// filling a page of a file mapping locks that file's inode and
+// reads its blocks (see vmafault()), and may sleep. Stops at
+// the first page that cannot be made present; the copy itself
+// will then fail there.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      if(vmfault(pagetable, a, write ? PTE_W : PTE_R) == 0)
+        return;
+      pte = walk(pagetable, a, 0);
+    }
+    if((*pte & PTE_U) == 0)
+      return;
+    if(write && (*pte & PTE_W) == 0 && uvmcow(pagetable, a) != 0)
+      return;
+  }
+}
+
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
@@ -393,7 +545,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, PTE_R)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -420,7 +572,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, PTE_R)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
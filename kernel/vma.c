@@ -0,0 +1,352 @@
+// Memory-mapped regions (VMAs) of a process's address space.
+//
+// mmap() records a mapping in p->vma[] without touching
+// memory. Pages are allocated on first touch by vmafault(),
+// and, for a file mapping, filled from the file through the
+// buffer cache.
+//
+// exec() also uses private file mappings for the program's
+// segments; only the first filesz bytes of such a mapping
+// come from the file, and the rest (the bss) reads as zero.
+//
+// Pages of a MAP_SHARED mapping that the process has written
+// (PTE_D) are written back to the file when they are unmapped,
+// by munmap(), exec() or exit(). Pages of a MAP_PRIVATE
+// mapping are never written back.
+//
+// MAP_SHARED is weaker than in Unix. There is no page cache:
+// each process faults in its own copy of a page, so processes
+// share a page only if it was present when one of them fork()ed
+// the other. Stores to a page are not seen by read(), by other
+// processes that map the file, or by writes to the file, until
+// the page is unmapped. Whole pages are written back, so when
+// two processes have written their own copies of a page, the
+// one that unmaps it last wins, even for bytes it did not store.
+//
+// New mappings are placed top-down, below the lowest existing
+// mapping, starting just under the trapframe; the heap may not
+// grow into them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+// Return the mapping of p that contains va, or 0.
+struct vma*
+vmamapped(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by any mapping of p above its heap,
+// or TRAPFRAME if there are none. The heap must stay below it.
+// (exec() maps the program's segments below p->sz.)
+uint64
+vmabase(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && v->addr >= p->sz && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Does [addr, addr+len) overlap a mapping of p?
+static int
+vmaoverlap(struct proc *p, uint64 addr, uint64 len)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && addr < v->addr + v->len && v->addr < addr + len)
+      return 1;
+  return 0;
+}
+
+// Write n bytes of kernel memory at src to the file of a
+// shared mapping, at offset off, as many blocks per transaction
+// as filewrite() does. Nothing is written beyond the end of the
+// file.
+static void
+vmawrite(struct file *f, uint64 src, uint off, int n)
+{
+  int max = filewritemax();
+  int i, n1, r;
+
+  for(i = 0; i < n; i += r){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op(OPBLOCKS_WRITE(n1));
+    ilock(f->ip);
+    if(off + i >= f->ip->size)
+      n1 = 0;
+    else if(off + i + n1 > f->ip->size)
+      n1 = f->ip->size - (off + i);
+    r = n1 > 0 ? writei(f->ip, 0, src + i, off + i, n1) : 0;
+    iunlock(f->ip);
+    end_op();
+    if(r <= 0)
+      break;
+  }
+}
+
+// Remove the pages of v in [start, end) from p's page table,
+// writing back any dirty pages of a shared mapping.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 va;
+  pte_t *pte;
+
+  if((v->flags & MAP_SHARED) && v->f){
+    for(va = start; va < end; va += PGSIZE){
+      pte = walk(p->pagetable, va, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+        vmawrite(v->f, PTE2PA(*pte), v->off + (va - v->addr), PGSIZE);
+    }
+  }
+  uvmunmapsparse(p->pagetable, start, (end - start) / PGSIZE, 1);
+}
+
+// Map len bytes of file f (or zeros, if f is 0) at offset off
+// into the current process. addr is a hint: it is used if it
+// is page-aligned and free, and otherwise ignored.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  len = PGROUNDUP(len);
+
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      free = v;
+      break;
+    }
+  }
+  if(free == 0)
+    return -1;
+
+  if(addr == 0 || addr % PGSIZE != 0 || addr < PGROUNDUP(p->sz) ||
+     addr + len > TRAPFRAME || addr + len < addr || vmaoverlap(p, addr, len)){
+    addr = vmabase(p) - len;
+    if(addr > vmabase(p) || addr < PGROUNDUP(p->sz))
+      return -1;
+  }
+
+  v = free;
+  v->addr = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  v->filesz = len;
+  return addr;
+}
+
+// Remove the mappings in [addr, addr+len) of the current process.
+// A mapping that is only partly covered keeps the rest; one
+// that is punched in the middle is split in two.
+// Returns 0, or -1 if addr is not page-aligned or a split
+// needs a free VMA slot and there is none.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+  uint64 start, end;
+
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || addr + len <= v->addr || v->addr + v->len <= addr)
+      continue;
+    start = addr > v->addr ? addr : v->addr;
+    end = addr + len < v->addr + v->len ? addr + len : v->addr + v->len;
+
+    if(start > v->addr && end < v->addr + v->len){
+      // punch a hole: the part above it becomes a new mapping.
+      for(nv = p->vma; nv < &p->vma[NVMA] && nv->len; nv++)
+        ;
+      if(nv == &p->vma[NVMA])
+        return -1;
+      vmaunmap(p, v, start, end);
+      *nv = *v;
+      nv->addr = end;
+      nv->len = v->addr + v->len - end;
+      nv->off = v->off + (end - v->addr);
+      nv->filesz = v->filesz > end - v->addr ? v->filesz - (end - v->addr) : 0;
+      if(nv->f)
+        filedup(nv->f);
+      v->len = start - v->addr;
+      continue;
+    }
+
+    vmaunmap(p, v, start, end);
+    if(start == v->addr && end == v->addr + v->len){
+      if(v->f)
+        fileclose(v->f);
+      v->f = 0;
+      v->len = 0;
+    } else if(start == v->addr){
+      v->off += end - v->addr;
+      v->filesz = v->filesz > end - v->addr ? v->filesz - (end - v->addr) : 0;
+      v->len -= end - v->addr;
+      v->addr = end;
+    } else {
+      v->len = start - v->addr;
+    }
+  }
+  return 0;
+}
+
+// Unmap every mapping of p, as exec() and exit() must.
+void
+vmafree(struct proc *p)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(p, v, v->addr, v->addr + v->len);
+    if(v->f)
+      fileclose(v->f);
+    v->f = 0;
+    v->len = 0;
+  }
+}
+
+// Give child np the mappings of p. Pages already present are
+// shared: those of a private mapping copy-on-write, those of
+// a shared mapping as they are.
+// Returns 0, or -1 (leaving np with no mapped pages) if out
+// of memory.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || v->addr < p->sz)
+      continue;  // uvmcopy() has already shared the program image.
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                (v->flags & MAP_PRIVATE) != 0) < 0){
+      for(struct vma *u = p->vma; u < v; u++)
+        if(u->len && u->addr >= p->sz)
+          uvmunmapsparse(np->pagetable, u->addr, u->len / PGSIZE, 1);
+      return -1;
+    }
+  }
+  for(int i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].len && np->vma[i].f)
+      filedup(np->vma[i].f);
+  }
+  return 0;
+}
+
+// Handle a page fault at va in a mapping of p, for an access
+// of kind PTE_R, PTE_W or PTE_X. Allocates the page, fills it
+// from the file, and maps it with the mapping's protection.
+// Returns the page's physical address, or 0 if va is in no
+// mapping, the access is not allowed, or memory is exhausted.
+uint64
+vmafault(struct proc *p, uint64 va, int access)
+{
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  uint64 pa;
+  int perm, shared;
+  uint off, n;
+
+  if((v = vmamapped(p, va)) == 0)
+    return 0;
+  perm = PTE_U;
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if((perm & access) != access)
+    return 0;
+
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // hardware that does not manage the dirty bit itself
+    // faults on the first store to a clean page.
+    if(access == PTE_W && (*pte & PTE_W) && (*pte & PTE_D) == 0){
+      *pte |= PTE_A|PTE_D;
+      return PTE2PA(*pte);
+    }
+    return 0;
+  }
+
+  pa = 0;
+  if(v->f && va - v->addr < v->filesz){
+    ip = v->f->ip;
+    off = v->off + (va - v->addr);
+    n = v->filesz - (va - v->addr);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    // read-only pages can be shared with other processes
+    // mapping the same file; see text.c.
+    shared = (v->prot & PROT_WRITE) == 0;
+    // the faulting process must hold no inode or buffer
+    // locks: read() and write() fault in user buffers before
+    // taking any (see uvmprefault()).
+    ilock(ip);
+    if(shared)
+      pa = textget(ip, off, n);
+    if(pa == 0 && (pa = (uint64)kalloc()) != 0){
+      memset((void*)pa, 0, PGSIZE);
+      readi(ip, 0, pa, off, n);
+      fileahead(v->f, off, n);
+      if(shared)
+        textput(ip, off, n, pa);
+    }
+    iunlock(ip);
+  } else if((pa = (uint64)kalloc()) != 0){
+    memset((void*)pa, 0, PGSIZE);
+  }
+  if(pa == 0)
+    return 0;
+
+  if(access == PTE_W)
+    perm |= PTE_A|PTE_D;
+  if(mappages(p->pagetable, va, PGSIZE, pa, perm) != 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  return pa;
+}
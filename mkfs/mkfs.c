@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/BPB + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;     // Number of log blocks (header and data)
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -89,6 +89,14 @@ main(int argc, char *argv[])
   if(fsfd < 0)
     die(argv[1]);
 
+  // give the log about 1/16 of the disk, within what the
+  // kernel can use; half of it must hold any one FS operation.
+  nlog = FSSIZE / 16;
+  if(nlog > LOGSIZE + 1)
+    nlog = LOGSIZE + 1;
+  if(nlog < 2*OPBLOCKS_DIR + 1)
+    nlog = 2*OPBLOCKS_DIR + 1;
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -171,6 +179,12 @@ main(int argc, char *argv[])
 
   balloc(freeblock);
 
+  sb.nfree = xint(nblocks - (freeblock - nmeta));
+  sb.nifree = xint(NINODES - freeinode);
+  memset(buf, 0, sizeof(buf));
+  memmove(buf, &sb, sizeof(sb));
+  wsect(1, buf);
+
   exit(0);
 }
 
@@ -251,6 +265,43 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of the file with
+// inode din, allocating it and any indirect blocks on
+// the way.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint *ap, x, n = 1, i;
+  int level;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    ap = &din->addrs[fbn];
+    level = 0;
+  } else {
+    fbn -= NDIRECT;
+    for(level = 1, n = NINDIRECT; fbn >= n; level++, n *= NINDIRECT)
+      fbn -= n;
+    ap = &din->addrs[NDIRECT+level-1];
+  }
+  if(xint(*ap) == 0)
+    *ap = xint(freeblock++);
+  x = xint(*ap);
+  for(; level > 0; level--){
+    n /= NINDIRECT;
+    i = fbn / n;
+    rsect(x, (char*)indirect);
+    if(indirect[i] == 0){
+      indirect[i] = xint(freeblock++);
+      wsect(x, (char*)indirect);
+    }
+    x = xint(indirect[i]);
+    fbn %= n;
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,7 +309,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -266,23 +316,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
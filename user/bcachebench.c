@@ -0,0 +1,107 @@
+// Measure file read throughput with several processes reading
+// the same cached file at once, to show how the buffer cache
+// scales with the number of harts (make CPUS=n qemu).
+//
+// usage: bcachebench [maxprocs]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILEKB  8     // size of the file, small enough to stay cached
+#define NTICKS  20    // length of each measurement
+
+char buf[1024];
+
+// Read the whole file over and over until NTICKS have passed.
+// Reports the number of kilobytes read through fd.
+void
+worker(int fd, int start)
+{
+  int kb = 0;
+
+  while(uptime() < start)
+    ;
+  while(uptime() < start + NTICKS){
+    int f = open("bcachebench.tmp", O_RDONLY);
+    if(f < 0){
+      printf("bcachebench: open failed\n");
+      exit(1);
+    }
+    while(read(f, buf, sizeof(buf)) == sizeof(buf))
+      kb++;
+    close(f);
+  }
+  write(fd, &kb, sizeof(kb));
+  exit(0);
+}
+
+int
+run(int nproc)
+{
+  int fds[2], total, kb;
+  int start;
+
+  if(pipe(fds) < 0){
+    printf("bcachebench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime() + 2;
+  for(int i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bcachebench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      worker(fds[1], start);
+    }
+  }
+  close(fds[1]);
+  total = 0;
+  while(read(fds[0], &kb, sizeof(kb)) == sizeof(kb))
+    total += kb;
+  close(fds[0]);
+  for(int i = 0; i < nproc; i++)
+    wait(0);
+  return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxprocs = 4;
+  int fd;
+
+  if(argc > 1)
+    maxprocs = atoi(argv[1]);
+  if(maxprocs < 1){
+    printf("usage: bcachebench [maxprocs]\n");
+    exit(1);
+  }
+
+  fd = open("bcachebench.tmp", O_CREATE|O_WRONLY|O_TRUNC);
+  if(fd < 0){
+    printf("bcachebench: create failed\n");
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for(int i = 0; i < FILEKB; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachebench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  printf("bcachebench: %d KB file, %d ticks per run\n", FILEKB, NTICKS);
+  for(int n = 1; n <= maxprocs; n *= 2){
+    int kb = run(n);
+    // a tick is about a tenth of a second.
+    printf("%d procs: %d KB read, %d KB/sec\n", n, kb, kb * 10 / NTICKS);
+  }
+  unlink("bcachebench.tmp");
+  exit(0);
+}
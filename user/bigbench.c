@@ -0,0 +1,113 @@
+// Measure the throughput of writing and then reading back
+// a multi-megabyte file, which needs doubly-indirect blocks
+// (and, past 64 MB, triply-indirect ones).
+//
+// Before reading, a child process allocates memory until it
+// runs out and is killed, which makes the kernel take the
+// buffer cache's pages back (see bshrink()), so the file has
+// to come from the disk. Expect the kernel to report the
+// child's fatal page fault.
+//
+// With -e, the file's blocks are mapped by extents (O_EXTENT).
+//
+// usage: bigbench [-e] [megabytes]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define CHUNK  (64*1024)  // bytes per read() or write()
+
+char buf[CHUNK];
+
+// Use up free memory, and so shrink the buffer cache.
+void
+flush(void)
+{
+  int pid = fork();
+
+  if(pid < 0){
+    printf("bigbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;){
+      char *p = sbrk(4096);
+      if(p == (char*)-1)
+        exit(0);
+      *p = 1;
+    }
+  }
+  wait(0);
+}
+
+void
+report(char *what, int kb, int ticks)
+{
+  if(ticks == 0)
+    ticks = 1;
+  // a tick is about a tenth of a second.
+  printf("%s: %d KB in %d ticks, %d KB/sec\n", what, kb, ticks, kb * 10 / ticks);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 8, omode = 0;
+  int fd, i, n, start, nchunk;
+
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    omode = O_EXTENT;
+    argc--;
+    argv++;
+  }
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb < 1){
+    printf("usage: bigbench [-e] [megabytes]\n");
+    exit(1);
+  }
+  nchunk = mb * (1024*1024 / CHUNK);
+
+  fd = open("bigbench.tmp", O_CREATE|O_WRONLY|O_TRUNC|omode);
+  if(fd < 0){
+    printf("bigbench: create failed\n");
+    exit(1);
+  }
+  start = uptime();
+  for(i = 0; i < nchunk; i++){
+    buf[0] = i;
+    if(write(fd, buf, CHUNK) != CHUNK){
+      printf("bigbench: write failed after %d KB\n", i * (CHUNK/1024));
+      unlink("bigbench.tmp");
+      exit(1);
+    }
+  }
+  close(fd);
+  report("write", mb * 1024, uptime() - start);
+
+  flush();
+
+  fd = open("bigbench.tmp", O_RDONLY);
+  if(fd < 0){
+    printf("bigbench: open failed\n");
+    exit(1);
+  }
+  start = uptime();
+  for(i = 0; (n = read(fd, buf, CHUNK)) == CHUNK; i++){
+    if(buf[0] != (char)i){
+      printf("bigbench: wrong data at %d KB\n", i * (CHUNK/1024));
+      exit(1);
+    }
+  }
+  close(fd);
+  if(i != nchunk){
+    printf("bigbench: short read\n");
+    exit(1);
+  }
+  report("read", mb * 1024, uptime() - start);
+
+  unlink("bigbench.tmp");
+  exit(0);
+}
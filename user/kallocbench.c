@@ -0,0 +1,92 @@
+// Measure page allocation throughput with several processes
+// allocating and freeing memory at once, to show how kalloc()
+// and kfree() scale with the number of harts (make CPUS=n qemu).
+//
+// usage: kallocbench [maxprocs]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NPAGES  64    // pages grown and shrunk per round
+#define NTICKS  20    // length of each measurement
+
+// Grow and shrink the heap until NTICKS have passed,
+// touching each page so that it is really allocated.
+// Reports the number of pages allocated through fd.
+void
+worker(int fd, int start)
+{
+  int rounds = 0;
+
+  while(uptime() < start)
+    ;
+  while(uptime() < start + NTICKS){
+    char *p = sbrk(NPAGES*4096);
+    if(p == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < NPAGES; i++)
+      p[i*4096] = 1;
+    sbrk(-NPAGES*4096);
+    rounds++;
+  }
+  int pages = rounds * NPAGES;
+  write(fd, &pages, sizeof(pages));
+  exit(0);
+}
+
+int
+run(int nproc)
+{
+  int fds[2], total, pages;
+  int start;
+
+  if(pipe(fds) < 0){
+    printf("kallocbench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime() + 2;
+  for(int i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("kallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      worker(fds[1], start);
+    }
+  }
+  close(fds[1]);
+  total = 0;
+  while(read(fds[0], &pages, sizeof(pages)) == sizeof(pages))
+    total += pages;
+  close(fds[0]);
+  for(int i = 0; i < nproc; i++)
+    wait(0);
+  return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxprocs = 4;
+
+  if(argc > 1)
+    maxprocs = atoi(argv[1]);
+  if(maxprocs < 1){
+    printf("usage: kallocbench [maxprocs]\n");
+    exit(1);
+  }
+
+  printf("kallocbench: %d pages per round, %d ticks per run\n", NPAGES, NTICKS);
+  for(int n = 1; n <= maxprocs; n *= 2){
+    int pages = run(n);
+    // a tick is about a tenth of a second.
+    printf("%d procs: %d page allocs, %d allocs/sec\n",
+           n, pages, pages * 10 / NTICKS);
+  }
+  exit(0);
+}
@@ -0,0 +1,77 @@
+// Measure how long an interactive process waits for a cpu
+// while CPU-bound processes keep every hart busy.
+//
+// The interactive process sleeps for one tick at a time and
+// counts the ticks by which it wakes up late. It runs once with
+// the CPU-bound processes at the default priority, where the
+// scheduler should soon rank them below it, and once with them
+// made as nice as possible with nice().
+//
+// usage: latbench [spinners]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define NSLEEP  50    // sleeps per run
+
+int pids[NPROC];
+
+// Sleep NSLEEP times and report how late the wakeups were.
+void
+measure(char *what)
+{
+  int i, t, late, total = 0, max = 0;
+
+  for(i = 0; i < NSLEEP; i++){
+    t = uptime();
+    sleep(1);
+    late = uptime() - t - 1;
+    if(late < 0)
+      late = 0;
+    total += late;
+    if(late > max)
+      max = late;
+  }
+  printf("%s: %d sleeps, %d ticks late in all, at most %d\n",
+         what, NSLEEP, total, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = 4;
+  int i;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1 || n > NPROC / 2){
+    printf("usage: latbench [spinners]\n");
+    exit(1);
+  }
+
+  for(i = 0; i < n; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("latbench: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0){
+      for(;;)
+        ;
+    }
+  }
+  sleep(2);  // let the spinners use up their quanta
+
+  measure("spinners nice 0");
+  for(i = 0; i < n; i++)
+    nice(pids[i], NPRIO - 1);
+  measure("spinners nice max");
+
+  for(i = 0; i < n; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  exit(0);
+}
@@ -0,0 +1,112 @@
+// Measure sequential read throughput of a file that is not
+// in the buffer cache, with and without readahead.
+//
+// Before each pass, a child process allocates memory until
+// it runs out and is killed, which makes the kernel take the
+// buffer cache's pages back (see bshrink()), so the file has
+// to come from the disk again. Expect the kernel to report
+// the child's fatal page fault.
+//
+// usage: rabench [rounds]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILEKB  256   // size of the file; files hold at most 268 KB
+
+char buf[1024];
+
+// Use up free memory, and so shrink the buffer cache.
+void
+flush(void)
+{
+  int pid = fork();
+
+  if(pid < 0){
+    printf("rabench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;){
+      char *p = sbrk(4096);
+      if(p == (char*)-1)
+        exit(0);
+      *p = 1;
+    }
+  }
+  wait(0);
+}
+
+// Read the whole file once; return the ticks it took.
+int
+pass(int omode)
+{
+  int fd, n, start, kb = 0;
+
+  fd = open("rabench.tmp", omode);
+  if(fd < 0){
+    printf("rabench: open failed\n");
+    exit(1);
+  }
+  start = uptime();
+  while((n = read(fd, buf, sizeof(buf))) == sizeof(buf))
+    kb++;
+  n = uptime() - start;
+  close(fd);
+  if(kb != FILEKB){
+    printf("rabench: short read\n");
+    exit(1);
+  }
+  return n;
+}
+
+void
+run(char *name, int omode, int rounds)
+{
+  int ticks = 0;
+
+  for(int i = 0; i < rounds; i++){
+    flush();
+    ticks += pass(omode);
+  }
+  if(ticks == 0)
+    ticks = 1;
+  // a tick is about a tenth of a second.
+  printf("%s: %d KB in %d ticks, %d KB/sec\n",
+         name, FILEKB * rounds, ticks, FILEKB * rounds * 10 / ticks);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rounds = 4;
+  int fd;
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+  if(rounds < 1){
+    printf("usage: rabench [rounds]\n");
+    exit(1);
+  }
+
+  fd = open("rabench.tmp", O_CREATE|O_WRONLY|O_TRUNC);
+  if(fd < 0){
+    printf("rabench: create failed\n");
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for(int i = 0; i < FILEKB; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("rabench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  run("no readahead", O_RDONLY|O_NOREADAHEAD, rounds);
+  run("readahead", O_RDONLY, rounds);
+  unlink("rabench.tmp");
+  exit(0);
+}
@@ -0,0 +1,110 @@
+// Measure context switch throughput with several pairs of
+// processes, each pair passing a byte back and forth over two
+// pipes, to show how the scheduler scales with the number of
+// harts (make CPUS=n qemu). Every pass of the byte puts one
+// process to sleep and wakes the other.
+//
+// usage: schedbench [maxpairs]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NTICKS  20    // length of each measurement
+
+// One side of a pair: pass the byte from in to out until
+// NTICKS have passed. The first side reports the number of
+// passes through fd.
+void
+player(int in, int out, int first, int fd, int start)
+{
+  int passes = 0;
+  char c = 0;
+
+  while(uptime() < start)
+    ;
+  if(first)
+    write(out, &c, 1);
+  while(read(in, &c, 1) == 1){
+    if(first && uptime() >= start + NTICKS)
+      break;  // closing out stops the other side.
+    if(write(out, &c, 1) != 1)
+      break;
+    passes += 2;
+  }
+  if(first)
+    write(fd, &passes, sizeof(passes));
+  exit(0);
+}
+
+int
+run(int npair)
+{
+  int fds[2], ping[2], pong[2], total, passes;
+  int start;
+
+  if(pipe(fds) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime() + 2;
+  for(int i = 0; i < npair; i++){
+    if(pipe(ping) < 0 || pipe(pong) < 0){
+      printf("schedbench: pipe failed\n");
+      exit(1);
+    }
+    for(int side = 0; side < 2; side++){
+      int pid = fork();
+      if(pid < 0){
+        printf("schedbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        close(fds[0]);
+        if(side == 0){
+          close(ping[0]);
+          close(pong[1]);
+          player(pong[0], ping[1], 1, fds[1], start);
+        } else {
+          close(ping[1]);
+          close(pong[0]);
+          player(ping[0], pong[1], 0, fds[1], start);
+        }
+      }
+    }
+    close(ping[0]);
+    close(ping[1]);
+    close(pong[0]);
+    close(pong[1]);
+  }
+  close(fds[1]);
+  total = 0;
+  while(read(fds[0], &passes, sizeof(passes)) == sizeof(passes))
+    total += passes;
+  close(fds[0]);
+  for(int i = 0; i < 2*npair; i++)
+    wait(0);
+  return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxpairs = 4;
+
+  if(argc > 1)
+    maxpairs = atoi(argv[1]);
+  if(maxpairs < 1){
+    printf("usage: schedbench [maxpairs]\n");
+    exit(1);
+  }
+
+  printf("schedbench: %d ticks per run\n", NTICKS);
+  for(int n = 1; n <= maxpairs; n *= 2){
+    int passes = run(n);
+    // a tick is about a tenth of a second.
+    printf("%d pairs: %d passes, %d passes/sec\n",
+           n, passes, passes * 10 / NTICKS);
+  }
+  exit(0);
+}
@@ -22,6 +22,9 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int nice(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
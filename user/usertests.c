@@ -578,6 +578,9 @@ writetest(char *s)
   }
 }
 
+// write a file that reaches into the doubly-indirect blocks.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + NINDIRECT)
+
 void
 writebig(char *s)
 {
@@ -589,7 +592,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +612,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -632,6 +635,173 @@ writebig(char *s)
   }
 }
 
+// write nblock blocks to a new file, eight at a time,
+// with each block's number in its first word, then
+// read the file back and check the numbers.
+void
+writeread(char *s, char *name, int nblock, int omode)
+{
+  int i, j, fd, n;
+
+  unlink(name);
+  fd = open(name, O_CREATE|O_RDWR|omode);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, name);
+    exit(1);
+  }
+  for(i = 0; i < nblock; i += n){
+    n = nblock - i < 8 ? nblock - i : 8;
+    for(j = 0; j < n; j++)
+      ((int*)(buf + j*BSIZE))[0] = i + j;
+    if(write(fd, buf, n*BSIZE) != n*BSIZE){
+      printf("%s: write %s failed at block %d\n", s, name, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0){
+    printf("%s: open %s failed\n", s, name);
+    exit(1);
+  }
+  for(i = 0; i < nblock; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read %s failed at block %d\n", s, name, i);
+      exit(1);
+    }
+    if(((int*)buf)[0] != i){
+      printf("%s: block %d of %s holds %d\n", s, i, name, ((int*)buf)[0]);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, BSIZE) != 0){
+    printf("%s: %s too long\n", s, name);
+    exit(1);
+  }
+  close(fd);
+  if(unlink(name) < 0){
+    printf("%s: unlink %s failed\n", s, name);
+    exit(1);
+  }
+}
+
+// a multi-megabyte file, in the doubly-indirect blocks.
+void
+hugefile(char *s)
+{
+  writeread(s, "huge", 4096, 0);
+}
+
+// extent-mapped files: one written alone, then two written
+// a block at a time in turn, so neither can grow in place.
+void
+extentfile(char *s)
+{
+  int fd[2], i, k;
+  char *names[2] = { "ext0", "ext1" };
+
+  writeread(s, "ext", 4096, O_EXTENT);
+
+  for(k = 0; k < 2; k++){
+    unlink(names[k]);
+    fd[k] = open(names[k], O_CREATE|O_RDWR|O_EXTENT);
+    if(fd[k] < 0){
+      printf("%s: create %s failed\n", s, names[k]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 64; i++){
+    for(k = 0; k < 2; k++){
+      ((int*)buf)[0] = i * 2 + k;
+      if(write(fd[k], buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed at block %d\n", s, names[k], i);
+        exit(1);
+      }
+    }
+  }
+  for(k = 0; k < 2; k++){
+    close(fd[k]);
+    fd[k] = open(names[k], O_RDONLY);
+    for(i = 0; i < 64; i++){
+      if(read(fd[k], buf, BSIZE) != BSIZE || ((int*)buf)[0] != i * 2 + k){
+        printf("%s: block %d of %s is wrong\n", s, i, names[k]);
+        exit(1);
+      }
+    }
+    close(fd[k]);
+    unlink(names[k]);
+  }
+}
+
+// fill the buffer cache with a file's blocks, then use up all
+// free memory, which makes kalloc() take pages back from the
+// cache with bshrink(). the file must still read back intact.
+void
+cacheshrink(char *s)
+{
+  enum { NCHUNK = 4*1024*1024 / BUFSZ };
+  int fd, i, j, pid, xstatus;
+
+  unlink("cacheshrink");
+  fd = open("cacheshrink", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHUNK; i++){
+    memset(buf, i, BUFSZ);
+    if(write(fd, buf, BUFSZ) != BUFSZ){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // the kernel reports the child's fatal page fault.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;){
+      char *p = sbrk(4096);
+      if(p == (char*)0xffffffffffffffffL)
+        exit(0);
+      *p = 1;
+    }
+  }
+  wait(&xstatus);
+
+  fd = open("cacheshrink", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHUNK; i++){
+    if(read(fd, buf, BUFSZ) != BUFSZ){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < BUFSZ; j++){
+      if(buf[j] != (char)i){
+        printf("%s: wrong data in chunk %d\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  unlink("cacheshrink");
+}
+
+// a file that needs the triply-indirect blocks.
+void
+triplefile(char *s)
+{
+  writeread(s, "triple", NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + 64, 0);
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -733,6 +903,72 @@ exectest(char *s)
 
 }
 
+// a running program's file cannot be opened for writing, nor
+// written through a file opened before the exec, since its
+// pages are read from the file on demand.
+void
+textbusy(char *s)
+{
+  int in[2], out[2], fd, fdw, pid, xstatus;
+  char *catargv[] = { "cat", 0 };
+  char elf[4], c;
+
+  if((fdw = open("cat", O_RDWR)) < 0 || (fd = open("cat", O_RDONLY)) < 0 ||
+     read(fd, elf, sizeof(elf)) != sizeof(elf)){
+    printf("%s: open cat failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(fdw);
+    exec("cat", catargv);
+    exit(1);
+  }
+  close(in[0]);
+  close(out[1]);
+  // once cat echoes a byte, it is running.
+  if(write(in[1], "x", 1) != 1 || read(out[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: cat did not run\n", s);
+    exit(1);
+  }
+
+  if((fd = open("cat", O_WRONLY)) >= 0){
+    printf("%s: opened running program for writing\n", s);
+    exit(1);
+  }
+  // writes the bytes that are there, in case it succeeds.
+  if(write(fdw, elf, sizeof(elf)) >= 0){
+    printf("%s: wrote running program\n", s);
+    exit(1);
+  }
+
+  close(in[1]);
+  wait(&xstatus);
+  close(out[0]);
+  if(write(fdw, elf, sizeof(elf)) != sizeof(elf)){
+    printf("%s: cannot write program after it exits\n", s);
+    exit(1);
+  }
+  close(fdw);
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1956,6 +2192,145 @@ iref(char *s)
   chdir("/");
 }
 
+// more inodes in use at once than the kernel used to have
+// room for: eight processes each hold fourteen files open.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 8, NFILE = 14 };
+  int i, j, fd, pid, fds[2], hold[2];
+  char name[8], c;
+
+  if(pipe(fds) != 0 || pipe(hold) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      close(hold[1]);
+      name[0] = 'm';
+      name[1] = 'i';
+      name[2] = 'a' + i;
+      name[4] = '\0';
+      for(j = 0; j < NFILE; j++){
+        name[3] = 'a' + j;
+        if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+          printf("%s: create %s failed\n", s, name);
+          write(fds[1], "f", 1);
+          exit(1);
+        }
+        unlink(name);  // freed when the child exits
+      }
+      write(fds[1], "x", 1);
+      // hold the files until the parent has heard from every child.
+      read(hold[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  close(hold[0]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(fds[0], &c, 1) != 1 || c != 'x'){
+      printf("%s: a child failed\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(hold[1]);
+  for(i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// lookups must see names come and go, however
+// often they were looked up before.
+void
+dcachetest(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < 3; i++){
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: opened dcd/f before it exists\n", s);
+      exit(1);
+    }
+    if(mkdir("dcd") != 0 || (fd = open("dcd/f", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dcd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcd/f", O_RDONLY)) < 0){
+      printf("%s: open dcd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(link("dcd/f", "dcd/g") != 0 || unlink("dcd/f") != 0){
+      printf("%s: link or unlink failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: opened dcd/f after unlink\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/g", O_RDONLY)) < 0){
+      printf("%s: open dcd/g failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    // the next round's dcd may reuse this one's inode.
+    if(unlink("dcd/g") != 0 || unlink("dcd") != 0){
+      printf("%s: cleanup failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/g", O_RDONLY) >= 0){
+      printf("%s: opened dcd/g after unlink\n", s);
+      exit(1);
+    }
+  }
+}
+
+// sleepers with different deadlines must each be woken,
+// and none before its time.
+void
+sleeptest(char *s)
+{
+  enum { NCHILD = 4 };
+  int i, pid, t, xstatus;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // the longest sleep starts first.
+      t = uptime();
+      if(sleep(2*(NCHILD-i)) != 0)
+        exit(1);
+      if(uptime() - t < 2*(NCHILD-i)){
+        printf("%s: sleep(%d) woke after %d ticks\n", s, 2*(NCHILD-i), uptime() - t);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -2586,6 +2961,291 @@ badarg(char *s)
   exit(0);
 }
 
+// copy-on-write fork: parent and child must each see only their
+// own stores to pages they share, including stores made by the
+// kernel on their behalf (read() into a shared page).
+void
+cowfork(char *s)
+{
+  enum { N = 64 };
+  char *p = sbrk(N*4096);
+  int fds[2], pid, xstatus;
+
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++)
+    p[i*4096] = i;
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < N; i++){
+      if(p[i*4096] != (char)i)
+        exit(1);
+      p[i*4096] = -i;
+    }
+    if(read(fds[0], p + 4096 + 1, 1) != 1 || p[4096 + 1] != 'x')
+      exit(1);
+    exit(0);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong memory\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if(p[i*4096] != (char)i){
+      printf("%s: child store leaked into parent\n", s);
+      exit(1);
+    }
+  }
+  if(p[4096 + 1] == 'x'){
+    printf("%s: child read() leaked into parent\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  exit(0);
+}
+
+// lazily allocated heap pages: untouched pages must read as
+// zero, survive fork, and work as system call buffers.
+void
+lazysbrk(char *s)
+{
+  enum { N = 1024 };
+  char *p = sbrk(N*4096);
+  int fd, pid, xstatus;
+
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  p[(N-1)*4096] = 'z';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[(N-1)*4096] != 'z' || p[(N/2)*4096] != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap contents\n", s);
+    exit(1);
+  }
+
+  // kernel reads from and writes to untouched pages.
+  fd = open("lazysbrk", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, p + 10*4096, 4096) != 4096){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("README", O_RDONLY);
+  if(fd < 0 || read(fd, p + 20*4096 + 100, 10) != 10){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("lazysbrk");
+
+  if(sbrk(-N*4096) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// mmap()/munmap(): file contents appear in a mapping, stores to a
+// MAP_SHARED mapping reach the file, stores to a MAP_PRIVATE one
+// do not, a forked child sees the parent's mappings, read() and
+// write() can use a mapping of the file they are reading or
+// writing, and wait() can store its status into a mapping.
+void
+mmaptest(char *s)
+{
+  enum { N = 3*4096 };
+  char *p, *q, b;
+  int fd, pid, xstatus;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    b = 'a' + i % 26;
+    if(write(fd, &b, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong mapped contents\n", s);
+      exit(1);
+    }
+  }
+  p[0] = 'X';
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  q = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(q == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(q[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(q[4096] != 'a' + 4096 % 26)
+      exit(1);
+    q[4096] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child could not use mapping\n", s);
+    exit(1);
+  }
+  q[1] = 'Z';
+  if(munmap(q, 4096) != 0 || munmap(q + 4096, N - 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, &b, 1) != 1 || read(fd, &b, 1) != 1 || b != 'Z'){
+    printf("%s: shared store not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i += 4096){
+    if(p[i] != 0){
+      printf("%s: anonymous memory not zero\n", s);
+      exit(1);
+    }
+    p[i] = 1;
+  }
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // read() a file into a mapping of itself, and write() a file
+  // from a mapping of itself. the pages are first touched by
+  // the copy, so faulting them in reads the very blocks that
+  // read() and write() are using.
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    b = 'a' + i % 26;
+    if(write(fd, &b, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  for(int w = 0; w < 2; w++){
+    fd = open("mmapfile", O_RDWR);
+    p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == (char*)0xffffffffffffffffL){
+      printf("%s: mmap shared failed\n", s);
+      exit(1);
+    }
+    if((w ? write(fd, p, N) : read(fd, p, N)) != N){
+      printf("%s: %s through own mapping failed\n", s, w ? "write" : "read");
+      exit(1);
+    }
+    for(int i = 0; i < N; i++){
+      if(p[i] != 'a' + i % 26){
+        printf("%s: wrong contents after %s\n", s, w ? "write" : "read");
+        exit(1);
+      }
+    }
+    close(fd);
+    if(munmap(p, N) != 0){
+      printf("%s: munmap failed\n", s);
+      exit(1);
+    }
+  }
+
+  // wait() stores the exit status into a page of a file
+  // mapping that has not been touched yet.
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(7);
+  if(wait((int*)(p + 4096)) != pid || *(int*)(p + 4096) != 7){
+    printf("%s: wait into mapping failed\n", s);
+    exit(1);
+  }
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  unlink("mmapfile");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2605,9 +3265,12 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {hugefile, "hugefile"},
+  {extentfile, "extentfile"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {textbusy, "textbusy"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
@@ -2632,7 +3295,10 @@ struct test {
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
+  {manyinodes, "manyinodes"},
+  {dcachetest, "dcache"},
   {forktest, "forktest"},
+  {sleeptest, "sleep"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2650,6 +3316,9 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {mmaptest, "mmaptest"},
 
   { 0, 0},
 };
@@ -2944,6 +3613,8 @@ struct test slowtests[] = {
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
+  {triplefile, "triplefile"},
+  {cacheshrink, "cacheshrink"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
     